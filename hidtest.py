@@ -4,6 +4,210 @@
 # pip3 install hidapi
 import hid
 import os
+import sys
+import time
+
+# must match the USB_STREAM_LANES the firmware was built with
+LANES = int(os.environ.get("USB_STREAM_LANES", "1"))
+
+# must match the USB_TRANSPORT the firmware was built with (hid, bulk or cdc)
+TRANSPORT = os.environ.get("USB_TRANSPORT", "hid")
+
+# set to 1 on hosts without the Windows HID driver bug (Linux hidraw)
+# to ask the device for stream packets without the padding
+SHORT_PACKETS = int(os.environ.get("HID_SHORT_PACKETS", "0"))
+
+# must match the USB_CHANNELS the firmware was built with
+CHANNELS = int(os.environ.get("USB_CHANNELS", "1"))
+
+# set to 1 to use the credit based flow control, the stream
+# packets are then only sent as long as the device has space
+CREDITS = int(os.environ.get("HID_CREDITS", "0"))
+
+# must match whether the firmware was built with USB_STREAM_CHECK,
+# every packet then has a sequence number and a CRC-8
+CHECK = int(os.environ.get("USB_STREAM_CHECK", "0"))
+
+# set to 1 to ask a firmware built with USB_STREAM_COMPRESS
+# for run length encoded stream packets
+COMPRESS = int(os.environ.get("HID_COMPRESS", "0"))
+
+# must match whether the firmware was built with USB_STREAM_TIMESTAMP,
+# every packet then has the time it was sent and its age in frames
+TIMESTAMP = int(os.environ.get("USB_STREAM_TIMESTAMP", "0"))
+
+# with more than one lane (or CHECK) every packet has a sequence
+# number, with more than one channel every packet has a channel
+# number, then follow the timestamp and with CHECK the CRC
+SEQUENCE = LANES > 1 or CHECK
+TIMESTAMP_OFFSET = 1 + SEQUENCE + (CHANNELS > 1)
+HEADER_SIZE = TIMESTAMP_OFFSET + 3 * TIMESTAMP + CHECK
+PAYLOAD_SIZE = 64 - HEADER_SIZE
+
+
+class StripedDevice:
+    # Opens all lanes (HID interfaces) of the device and stripes
+    # the OUT packets round robin across them, frame() has already
+    # given them their sequence numbers. IN packets are put back
+    # into the order of their sequence numbers. Message and driver
+    # packets from the device are not part of the sequence.
+
+    def __init__(self, vid, pid):
+        infos = sorted(hid.enumerate(vid, pid), key=lambda i: i["interface_number"])
+        self.lanes = []
+        for info in infos[:LANES]:
+            d = hid.device()
+            d.open_path(info["path"])
+            d.set_nonblocking(1)
+            self.lanes.append(d)
+        self.tx_count = 0
+        self.rx_seq = 0
+        self.pending = {}
+
+    def write(self, buf):
+        # buf is the report ID followed by the 64 byte packet
+        d = self.lanes[self.tx_count % len(self.lanes)]
+        self.tx_count += 1
+        return d.write(buf)
+
+    def read(self, size):
+        timeout = time.time() + 1
+        while time.time() < timeout:
+            if self.rx_seq in self.pending:
+                x = self.pending.pop(self.rx_seq)
+                self.rx_seq = (self.rx_seq + 1) & 0xff
+                return x
+            for d in self.lanes:
+                x = d.read(size)
+                if len(x) > 1:
+                    if x[0] in (254, 255):
+                        return x
+                    self.pending[x[1]] = x
+            time.sleep(0.001)
+        return []
+
+    def get_feature_report(self, report_id, size):
+        return self.lanes[0].get_feature_report(report_id, size)
+
+    def send_feature_report(self, buf):
+        return self.lanes[0].send_feature_report(buf)
+
+    def close(self):
+        for d in self.lanes:
+            d.close()
+
+
+def crc8(data):
+    # CRC-8 with polynomial 0x07, same as crc8.c in the firmware
+    crc = 0
+    for b in data:
+        crc ^= b
+        for i in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xff if crc & 0x80 else (crc << 1) & 0xff
+    return crc
+
+def payload_length(size):
+    # number of valid payload bytes, same as in the firmware
+    if size & 0xc0 == 0x40:
+        return size & 0x3f
+    return min(size, PAYLOAD_SIZE)
+
+def rle_encode(data, size):
+    # the same PackBits style encoding as rle.c in the firmware,
+    # encodes as much of data as fits into size bytes and returns
+    # the encoded bytes and the number of bytes consumed
+    out = []
+    i = 0
+    literals = 0
+    control = 0
+    while i < len(data):
+        b = data[i]
+        run = 1
+        while i + run < len(data) and run < 129 and data[i + run] == b:
+            run += 1
+        if run >= 3:
+            if len(out) + 2 > size:
+                break
+            out += [0x80 + run - 2, b]
+            literals = 0
+            i += run
+            continue
+        if literals == 0 or literals == 128:
+            if len(out) + 2 > size:
+                break
+            control = len(out)
+            out.append(0)
+            literals = 0
+        elif len(out) + 1 > size:
+            break
+        out[control] = literals
+        literals += 1
+        out.append(b)
+        i += 1
+    return out, i
+
+def rle_decode(x):
+    out = []
+    i = 0
+    while i < len(x):
+        c = x[i]
+        if c < 0x80:
+            out += x[i + 1:i + 2 + c]
+            i += 2 + c
+        else:
+            out += [x[i + 1]] * (c - 0x80 + 2)
+            i += 2
+    return out
+
+tx_seq = 0
+rx_seq = 0
+rx_lost = 0
+rx_crc_errors = 0
+
+# (host time in ms, device time in ms modulo 2048, age in frames)
+# of every received packet when TIMESTAMP is enabled
+rx_timestamps = []
+
+def frame(x, channel=0):
+    # x is the payload size (or magic number) followed by the
+    # payload, insert the rest of the header and pad to 64 bytes
+    global tx_seq
+    header = [x[0]]
+    if SEQUENCE:
+        header.append(tx_seq)
+        tx_seq = (tx_seq + 1) & 0xff
+    if CHANNELS > 1:
+        header.append(channel)
+    if TIMESTAMP:
+        header += [0, 0, 0]
+    payload = x[1:] + [0] * (PAYLOAD_SIZE - len(x) + 1)
+    if CHECK:
+        header.append(crc8(header + payload[:payload_length(x[0])]))
+    return header + payload
+
+def unframe(x):
+    # check and remove the header that frame() would add, returns
+    # the payload size (or magic number) followed by the payload
+    # and the channel, or an empty list if the packet is damaged
+    global rx_seq, rx_lost, rx_crc_errors
+    if len(x) < HEADER_SIZE:
+        return x, 0
+    channel = x[1 + SEQUENCE] if CHANNELS > 1 else 0
+    payload = x[HEADER_SIZE:]
+    if CHECK:
+        if x[HEADER_SIZE - 1] != crc8(x[:HEADER_SIZE - 1] + payload[:payload_length(x[0])]):
+            rx_crc_errors += 1
+            return [], 0
+        # only the stream and record packets have sequence numbers
+        if LANES == 1 and x[0] not in (254, 255):
+            rx_lost += (x[1] - rx_seq) & 0xff
+            rx_seq = (x[1] + 1) & 0xff
+    if TIMESTAMP:
+        t = x[TIMESTAMP_OFFSET] | x[TIMESTAMP_OFFSET + 1] << 8
+        rx_timestamps.append((time.monotonic() * 1000,
+                              (t & 0x7ff) + (t >> 11) / 32,
+                              x[TIMESTAMP_OFFSET + 2]))
+    return [x[0]] + payload, channel
 
 def send_hid_report(d, x):
     assert(len(x) == 64)
@@ -15,10 +219,36 @@ def send_hid_report(d, x):
     return d.write(buf)
 
 
-def send_string(d, text):
+# credit limit last advertised by the device (None = disabled)
+# and the number of stream packets sent so far, both modulo 256
+credit_limit = None
+tx_packets = 0
+
+def update_credit(x):
+    # credit updates are driver packets with the command 5
+    global credit_limit
+    if len(x) > 3 and x[0] == 254 and x[1] == 5:
+        credit_limit = x[3]
+
+def wait_for_credit(d):
+    # the device may take another packet as long as the
+    # number of packets sent is below the credit limit
+    while credit_limit is not None and not 0 < (credit_limit - tx_packets) & 0xff < 128:
+        print("received: " + recv_string(d).strip())
+
+def set_credits(d, on):
+    global credit_limit
+    send_driver_cmd(d, 5, on)
+    status, x = recv_driver_answer(d, 5)
+    credit_limit = x[0] if on and status == 0 else None
+    print("    sent: credits {}, limit {}".format(on, credit_limit))
+
+def send_string(d, text, channel=0):
+    global tx_packets
+    wait_for_credit(d)
     
-    # truncate to 63 bytes
-    text = text[:63]
+    # truncate to the maximum payload
+    text = text[:PAYLOAD_SIZE]
     
     # prepare header
     x = [len(text)]
@@ -27,21 +257,53 @@ def send_string(d, text):
         
     # pad with zero bytes to make
     # bugged windows HID driver happy
-    while len(x) < 64:
-        x.append(0)
-    
-    send_hid_report(d, x)
-    print("    sent: " + text)
+    send_hid_report(d, frame(x, channel))
+    tx_packets = (tx_packets + 1) & 0xff
+    print("    sent: " + text + (" on channel {}".format(channel) if CHANNELS > 1 else ""))
+
+record = []
+record_remaining = 0
+
+def parse_record_packet(x):
+    # returns the list of records completed in
+    # this packet, a record that is continued in
+    # the next packet is kept in record[]
+    global record, record_remaining
+    records = []
+    i = 0
+    while i < len(x):
+        if record_remaining == 0:
+            if x[i] == 0:
+                break
+            record_remaining = x[i]
+            record = []
+            i += 1
+        n = min(record_remaining, len(x) - i)
+        record += x[i:i + n]
+        record_remaining -= n
+        i += n
+        if record_remaining == 0:
+            records.append(record)
+    return records
 
 def recv_string(d):
     s = ""
-    x = d.read(64)
-    if len(x) > 1:
+    x, channel = unframe(d.read(64))
+    update_credit(x)
+    if len(x) > 1 and x[0] == 253:
+        for r in parse_record_packet(x[1:]):
+            print("  record: " + str(r))
+
+    if len(x) > 1 and x[0] < 128:
         
         # parse header and
         # extract payload
-        size = x[0]
-        x = x[1:][:size]
+        compressed = x[0] & 0x40
+        x = x[1:][:payload_length(x[0])]
+        if compressed:
+            x = rle_decode(x)
+        if CHANNELS > 1:
+            s = "[channel {}] ".format(channel)
         
         # convert to string
         for c in x:
@@ -50,26 +312,242 @@ def recv_string(d):
     return s
 
 def send_msg(d, led):
-    x = [0] * 64
+    x = [0] * 2
     x[0] = 255    # magic number
     x[1] = led    # first byte controls blue LED
-    send_hid_report(d, x)
+    send_hid_report(d, frame(x))
     print("    sent: Message packet with {}".format(led))
 
-def main():
-    led_toggle = 1
+def send_driver_cmd(d, cmd, *args):
+    x = [254, cmd]  # magic number for driver packets
+    x += args
+    send_hid_report(d, frame(x))
+
+def recv_driver_answer(d, cmd):
+    # skip stream data until the answer arrives
+    for i in range(100):
+        x, channel = unframe(d.read(64))
+        if len(x) > 2 and x[0] == 254 and x[1] == cmd:
+            return x[2], x[3:]
+    return None, None
+
+def get_stats(d):
+    send_driver_cmd(d, 1)
+    status, x = recv_driver_answer(d, 1)
+    if status != 0:
+        print("    statistics not available (compile with FIFO_STATS)")
+        return
+    names = ["high water", "passed", "dropped", "empty polls"]
+    for (fifo, offs) in [("usb_tx", 0), ("usb_rx", 16)]:
+        for i in range(4):
+            value = int.from_bytes(bytes(x[offs + 4 * i:offs + 4 * i + 4]), "little")
+            print("    {} {}: {}".format(fifo, names[i], value))
+
+def set_tx_policy(d, min_bytes, max_frames):
+    send_driver_cmd(d, 2, min_bytes, max_frames)
+    print("    sent: TX policy {} bytes / {} frames".format(min_bytes, max_frames))
+
+def get_check_stats(d):
+    send_driver_cmd(d, 6)
+    status, x = recv_driver_answer(d, 6)
+    print("    host:   lost {}, CRC errors {}".format(rx_lost, rx_crc_errors))
+    if status != 0:
+        print("    device: not available (compile with USB_STREAM_CHECK)")
+        return
+    lost = int.from_bytes(bytes(x[0:4]), "little")
+    errors = int.from_bytes(bytes(x[4:8]), "little")
+    print("    device: lost {}, CRC errors {}".format(lost, errors))
+
+def set_channel_weight(d, channel, weight):
+    send_driver_cmd(d, 4, channel, weight)
+    print("    sent: channel {} weight {}".format(channel, weight))
+
+def set_short_packets(d, on):
+    send_driver_cmd(d, 3, on)
+    status, x = recv_driver_answer(d, 3)
+    print("    sent: short packets {}, status {}".format(on, status))
+
+def print_histogram(title, values, bucket):
+    print(title)
+    if not values:
+        return
+    counts = {}
+    for v in values:
+        counts[int(v // bucket)] = counts.get(int(v // bucket), 0) + 1
+    for b in range(min(counts), max(counts) + 1):
+        n = counts.get(b, 0)
+        print("  {:7.2f} ms {:6d} {}".format(b * bucket, n, "#" * (60 * n // len(values))))
+
+def print_latency():
+    # The device queuing delay is the age of the packets. The device
+    # clock (frame numbers) and the host clock are not synchronized,
+    # so the host delay (from the device arming the packet until it
+    # arrives here) is only known relative to the fastest packet.
+    # The jitter is how much the spacing of the arrivals differs
+    # from the spacing of the packets being sent.
+    if len(rx_timestamps) < 2:
+        return
+    host0, dev0, age = rx_timestamps[0]
+    delay = []
+    for host, dev, age in rx_timestamps:
+        delay.append(((host - host0) - (dev - dev0) + 1024) % 2048 - 1024)
+    fastest = min(delay)
+    delay = [x - fastest for x in delay]
+    jitter = [abs(b - a) for a, b in zip(delay, delay[1:])]
+    print_histogram("device queuing delay:", [x[2] for x in rx_timestamps], 1)
+    print_histogram("host delay (relative to the fastest packet):", delay, 0.25)
+    print_histogram("jitter (change of the host delay between packets):", jitter, 0.25)
+
+def get_feature_report(d):
+    # the feature report (over EP0) has no report ID, the
+    # API still wants one and may or may not return it
+    x = d.get_feature_report(0, 9)[-8:]
+    print("feature report: options {:#x}, channels {}, short packets {}, "
+          "compression {}, tx policy {} {}".format(*x[:6]))
+    return x
+
+def send_feature_report(d, x):
+    d.send_feature_report([0] + x)
+
+def set_compression(d, on):
+    send_driver_cmd(d, 7, on)
+    status, x = recv_driver_answer(d, 7)
+    print("    sent: compression {}, status {}".format(on, status))
+
+def compress_bench(paths):
+    # Offline benchmark of the stream compression on recorded
+    # traces (raw stream bytes as the application would write
+    # them to usb_tx), packed the same way as the firmware does
+    # when it always has enough data queued. One HID lane moves
+    # one packet per 1 ms frame at full speed.
+    for path in paths:
+        with open(path, "rb") as f:
+            data = list(f.read())
+        packets = 0
+        compressed = 0
+        decoded = []
+        i = 0
+        while i < len(data):
+            out, n = rle_encode(data[i:i + 129 * PAYLOAD_SIZE], PAYLOAD_SIZE)
+            if n > PAYLOAD_SIZE:
+                decoded += rle_decode(out)
+                compressed += 1
+            else:
+                n = min(PAYLOAD_SIZE, len(data) - i)
+                decoded += data[i:i + n]
+            i += n
+            packets += 1
+        assert decoded == data
+        raw_packets = -(-len(data) // PAYLOAD_SIZE)
+        print("{}: {} bytes, {} packets instead of {} ({} compressed)".format(
+            path, len(data), packets, raw_packets, compressed))
+        if packets:
+            print("    {:.1f} bytes per packet, {:.1f} kB/s per lane instead of {:.1f} kB/s".format(
+                len(data) / packets, len(data) / packets, len(data) / raw_packets))
+
+def control_test():
+    # Write a block of configuration data with one vendor control
+    # transfer (the OUT data stage spans many packets) and read it
+    # back, see usb_hook_control_request() in main.c. Vendor requests
+    # to the device need pyusb (libusb) instead of hidapi:
+    # pip3 install pyusb
+    import usb.core
+    d = usb.core.find(idVendor=0xdead, idProduct=0xbeef)
+    data = bytes((i * 7) & 0xff for i in range(1000))
+    start = time.time()
+    d.ctrl_transfer(0x40, 0x01, 0, 0, data)
+    x = d.ctrl_transfer(0xc0, 0x02, 0, 0, 1024)
+    duration = time.time() - start
+    print("control transfers: {} bytes written and read back in {:.1f} ms, {}".format(
+        len(data), duration * 1000, "ok" if bytes(x) == data else "MISMATCH"))
+
+def bulk_main():
+    # The bulk transport needs libusb (or WinUSB) instead of hidapi:
+    # pip3 install pyusb
+    # There is no framing, the firmware echoes the raw stream back,
+    # so this measures the round trip throughput of the bulk pipe.
+    import usb.core
+    d = usb.core.find(idVendor=0xdead, idProduct=0xbeef)
+    d.set_configuration()
+    size = 64 * 1024
+    data = bytes(i & 0xff for i in range(size))
+    received = 0
+    start = time.time()
+    # stay at most one chunk ahead, the firmware can only buffer
+    # so much before it stops accepting more OUT packets
+    chunk = 256
+    for i in range(0, size, chunk):
+        d.write(0x01, data[i:i + chunk])
+        while received < i:
+            received += len(d.read(0x81, 4096, 1000))
+    while received < size:
+        received += len(d.read(0x81, 4096, 1000))
+    elapsed = time.time() - start
+    print("echoed {} bytes in {:.3f} s, {:.1f} kB/s".format(
+        received, elapsed, received / elapsed / 1000))
+
+def cdc_main():
+    # The composite device has the stream on a CDC-ACM serial port
+    # and the message packets on the HID interface:
+    # pip3 install pyserial
+    import serial
+    port = serial.Serial(os.environ.get("USB_CDC_PORT", "/dev/ttyACM0"), timeout=0.1)
     d = hid.device()
     d.open(0xdead, 0xbeef)
+    led_toggle = 1
+    for i in range(100):
+        if i % 10 == 0:
+            port.write(b"Hello world!")
+            print("    sent: Hello world!")
+        if i % 11 == 0:
+            send_msg(d, led_toggle)
+            led_toggle = 1 - led_toggle
+        print("received: " + port.read(64).decode(errors="replace").strip())
+    get_stats(d)
+    d.close()
+    port.close()
+
+def main():
+    if TRANSPORT == "bulk":
+        return bulk_main()
+    if TRANSPORT == "cdc":
+        return cdc_main()
+    led_toggle = 1
+    if LANES > 1:
+        d = StripedDevice(0xdead, 0xbeef)
+    else:
+        d = hid.device()
+        d.open(0xdead, 0xbeef)
+
+    get_feature_report(d)
+    if SHORT_PACKETS:
+        set_short_packets(d, 1)
+    if CREDITS:
+        set_credits(d, 1)
+    if COMPRESS:
+        set_compression(d, 1)
 
     for i in range(100):
         if i % 10 == 0:
-            send_string(d, "Hello world!")
+            send_string(d, "Hello world!", i // 10 % CHANNELS)
         if i % 11 == 0:
             send_msg(d, led_toggle)
             led_toggle = 1 - led_toggle
         print("received: " + recv_string(d).strip())
 
+    get_stats(d)
+    if CHECK:
+        get_check_stats(d)
+    if TIMESTAMP:
+        print_latency()
     d.close()
 
 if __name__ == '__main__':
-    main()
+    # hidtest.py compress-bench <trace files>
+    # hidtest.py control-test
+    if len(sys.argv) > 2 and sys.argv[1] == "compress-bench":
+        compress_bench(sys.argv[2:])
+    elif len(sys.argv) > 1 and sys.argv[1] == "control-test":
+        control_test()
+    else:
+        main()
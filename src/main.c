@@ -1,20 +1,46 @@
+#include <string.h>
 #include "MKL25Z4.h"
 #include "gpio.h"
 #include "usb_device.h"
 
 volatile unsigned millitime = 0;
 
+/*
+ * A block of configuration data the host can write and
+ * read back over the control pipe with vendor requests.
+ */
+static uint8_t config[1024];
+static uint16_t config_size = 0;
+
 static void send_str(char* s) {
-    while (*s) {
-        fifo_push(&usb_tx, *s++);
+    usb_tx_write((uint8_t*)s, strlen(s));
+}
+
+/**
+ * Handle a message packet received from the host.
+ * @param data pointer to 63 bytes containing the message
+ */
+static void handle_message(uint8_t* data) {
+    if (data[0] == 1) {
+        LED_BL_low();
+        send_str("blue led has been turned on!\n");
+    } else {
+        LED_BL_high();
+        send_str("blue led has been turned off!\n");
     }
 }
 
 int main(void) {
 
     unsigned start_time = 0;
+#ifdef USB_ISO_ENDPOINT
+    unsigned iso_time = 0;
+    static uint8_t frame[USB_ISO_PACKET_SIZE];
+    uint8_t sample = 0;
+#endif
     uint8_t count = 0;
-    uint8_t c;
+    hid_packet_header_t* p;
+    uint8_t msg[USB_MESSAGE_SIZE];
 
     SysTick_Config(48000000/1000);
     gpio_init();
@@ -24,10 +50,25 @@ int main(void) {
         asm("wfi");
 
         /*
-         * pump everything from RX straight back into TX...
+         * handle the message packets from the host
+         */
+        while(usb_poll_message(msg)) {
+            handle_message(msg);
+        }
+
+        /*
+         * pump everything from RX straight back into TX (on the
+         * same channel), directly into the TX packet slots
+         * without copying...
          */
-        while(fifo_pop(&usb_rx, &c)) {
-            fifo_push(&usb_tx, c);
+        for (uint8_t ch = 0; ch < USB_CHANNELS; ch++) {
+            while(fifo_get_size(&usb_rx_channel[ch]) && (p = usb_tx_packet_reserve())) {
+                p->payload_size = usb_rx_read_channel(ch, (uint8_t*)p->payload_data, USB_PACKET_PAYLOAD_SIZE);
+#if USB_CHANNELS > 1
+                p->channel = ch;
+#endif
+                usb_tx_packet_commit();
+            }
         }
 
         /*
@@ -35,11 +76,26 @@ int main(void) {
          */
         if (millitime - start_time > 250) {
             start_time = millitime;
-            fifo_push(&usb_tx, 65 + count);
+            uint8_t c = 65 + count;
+            usb_tx_write(&c, 1);
             if (count++ == 25) {
                 count = 0;
             }
         }
+
+#ifdef USB_ISO_ENDPOINT
+        /*
+         * feed the isochronous stream with one frame of a
+         * sawtooth per millisecond, like a sampled sensor would
+         */
+        while (iso_time != millitime) {
+            iso_time++;
+            for (unsigned i = 0; i < sizeof(frame); i++) {
+                frame[i] = sample++;
+            }
+            usb_iso_write(frame, sizeof(frame));
+        }
+#endif
     }
 }
 
@@ -48,20 +104,6 @@ int main(void) {
  * Hooks and Interrupts
  */
 
-/**
- * Hook is called when receiving a message packet.
- * @param data pointer to 63 bytes containing the message
- */
-void usb_hook_message_packet(volatile uint8_t* data) {
-    if (data[0] == 1) {
-        LED_BL_low();
-        send_str("blue led has been turned on!\n");
-    } else {
-        LED_BL_high();
-        send_str("blue led has been turned off!\n");
-    }
-}
-
 /**
  * Hook is called to control the RX LED
  * @param on true if LED should be on, false otherwise
@@ -86,6 +128,32 @@ void usb_hook_led_tx(bool on) {
     }
 }
 
+/**
+ * Called when the configuration block has been written.
+ */
+static bool config_written(const setup_t* setup, uint8_t* data, uint16_t length) {
+    config_size = length;
+    return true;
+}
+
+/**
+ * Hook is called for class and vendor requests on EP0 that
+ * the driver does not handle itself.
+ * @return false to stall the request
+ */
+bool usb_hook_control_request(const setup_t* setup) {
+    switch (setup->wRequestAndType) {
+
+    case 0x0140: //vendor: write the configuration block
+        return usb_control_receive(config, sizeof(config), config_written);
+
+    case 0x02c0: //vendor: read the configuration block
+        usb_control_send(config, config_size);
+        return true;
+    }
+    return false;
+}
+
 void SysTick_Handler(void) {
     ++millitime;
 }
@@ -0,0 +1,15 @@
+/*
+ * crc8.h
+ *
+ *  Created on: 16.10.2026
+ *      Author: bernd
+ */
+
+#ifndef SRC_USB_CRC8_H_
+#define SRC_USB_CRC8_H_
+
+#include <stdint.h>
+
+uint8_t crc8(uint8_t crc, const volatile uint8_t* data, unsigned size);
+
+#endif /* SRC_USB_CRC8_H_ */
@@ -5,47 +5,213 @@
  *      Author: bernd
  */
 
+#include <string.h>
 #include "fifo.h"
 
+#ifdef FIFO_STATS
+static void stats_written(fifo_t* self, unsigned requested, unsigned written) {
+    unsigned size = self->write_index - self->read_index;
+    self->stats.passed += written;
+    self->stats.dropped += requested - written;
+    if (size > self->stats.high_water) {
+        self->stats.high_water = size;
+    }
+}
+
+static void stats_read(fifo_t* self, unsigned read) {
+    if (read == 0) {
+        self->stats.empty_polls++;
+    }
+}
+#else
+#define stats_written(self, requested, written) ((void)(requested))
+#define stats_read(self, read) ((void)(read))
+#endif
+
 void fifo_init(fifo_t* self, uint8_t* buffer, unsigned capacity) {
     self->capacity = capacity;
+    self->mask = capacity - 1;
     self->buffer = buffer;
     self->write_index = 0;
     self->read_index = 0;
+#ifdef FIFO_STATS
+    memset((void*)&self->stats, 0, sizeof(self->stats));
+#endif
 }
 
 unsigned fifo_get_size(fifo_t* self) {
-    int s = self->write_index - self->read_index;
-    if (s < 0) {
-        s += self->capacity;
-    }
-    return s;
+    return self->write_index - self->read_index;
+}
+
+unsigned fifo_get_free(fifo_t* self) {
+    return self->capacity - (self->write_index - self->read_index);
 }
 
 bool fifo_push(fifo_t* self, uint8_t byte) {
-    if (fifo_get_size(self) < self->capacity) {
-        unsigned i = self->write_index;
-        self->buffer[i++] = byte;
-        if (i == self->capacity) {
-            i = 0;
-        }
-        self->write_index = i;
+    unsigned i = self->write_index;
+    if (i - self->read_index < self->capacity) {
+        self->buffer[i & self->mask] = byte;
+        self->write_index = i + 1;
+        stats_written(self, 1, 1);
         return true;
     }
+    stats_written(self, 1, 0);
     return false;
 }
 
 bool fifo_pop(fifo_t* self, uint8_t* byte) {
-    if (fifo_get_size(self)) {
-        unsigned i = self->read_index;
-        *byte = self->buffer[i++];
-        if (i == self->capacity) {
-            i = 0;
-        }
-        self->read_index = i;
+    unsigned i = self->read_index;
+    if (self->write_index - i) {
+        *byte = self->buffer[i & self->mask];
+        self->read_index = i + 1;
         return true;
     }
+    stats_read(self, 0);
     return false;
 }
 
+static void copy_in(fifo_t* self, unsigned index, const uint8_t* data, unsigned count) {
+    unsigned pos = index & self->mask;
+    unsigned first = self->capacity - pos;
+    if (first > count) {
+        first = count;
+    }
+    memcpy((uint8_t*)&self->buffer[pos], data, first);
+    memcpy((uint8_t*)self->buffer, data + first, count - first);
+}
+
+/**
+ * Write up to count bytes into the FIFO with at most two
+ * memcpy() calls (one for the part up to the end of the
+ * buffer and one for the part that wraps around) and only
+ * one single update of the write index.
+ * @return the number of bytes actually written
+ */
+unsigned fifo_write(fifo_t* self, const uint8_t* data, unsigned count) {
+    unsigned i = self->write_index;
+    unsigned free = self->capacity - (i - self->read_index);
+    unsigned requested = count;
+    if (count > free) {
+        count = free;
+    }
+    copy_in(self, i, data, count);
+    self->write_index = i + count;
+    stats_written(self, requested, count);
+    return count;
+}
+
+/**
+ * Read up to count bytes from the FIFO with at most two
+ * memcpy() calls and only one single update of the read index.
+ * @return the number of bytes actually read
+ */
+unsigned fifo_read(fifo_t* self, uint8_t* data, unsigned count) {
+    unsigned capacity = self->capacity;
+    unsigned i = self->read_index;
+    unsigned size = self->write_index - i;
+    if (count > size) {
+        count = size;
+    }
+    unsigned pos = i & self->mask;
+    unsigned first = capacity - pos;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(data, (uint8_t*)&self->buffer[pos], first);
+    memcpy(data + first, (uint8_t*)self->buffer, count - first);
+    self->read_index = i + count;
+    stats_read(self, count);
+    return count;
+}
+
+/**
+ * Zero-copy write access: obtain a pointer to the free space
+ * at the write index so the caller can fill it in place. The
+ * data does not become visible to the reader until it is
+ * published with fifo_commit().
+ * @param data receives the pointer to the free space
+ * @return number of contiguous bytes that may be written
+ */
+unsigned fifo_reserve(fifo_t* self, uint8_t** data) {
+    unsigned capacity = self->capacity;
+    unsigned i = self->write_index;
+    unsigned pos = i & self->mask;
+    unsigned free = capacity - (i - self->read_index);
+    if (free > capacity - pos) {
+        free = capacity - pos;
+    }
+    *data = (uint8_t*)&self->buffer[pos];
+    return free;
+}
+
+/**
+ * Publish count bytes that have been written in place
+ * after a previous call to fifo_reserve().
+ */
+void fifo_commit(fifo_t* self, unsigned count) {
+    self->write_index += count;
+    stats_written(self, count, count);
+}
+
+/**
+ * Zero-copy read access: obtain a pointer to the stored data
+ * offset bytes behind the read index without consuming it.
+ * @param data receives the pointer to the data
+ * @return number of contiguous bytes that may be read there
+ */
+unsigned fifo_peek(fifo_t* self, unsigned offset, uint8_t** data) {
+    unsigned i = self->read_index + offset;
+    unsigned size = self->write_index - self->read_index;
+    if (offset >= size) {
+        return 0;
+    }
+    unsigned pos = i & self->mask;
+    size -= offset;
+    if (size > self->capacity - pos) {
+        size = self->capacity - pos;
+    }
+    *data = (uint8_t*)&self->buffer[pos];
+    return size;
+}
 
+/**
+ * Consume count bytes that have been read in place
+ * after a previous call to fifo_peek().
+ */
+void fifo_release(fifo_t* self, unsigned count) {
+    self->read_index += count;
+}
+
+/**
+ * Record mode: write one record consisting of a length byte
+ * followed by size bytes of data. The record is written either
+ * completely or not at all and becomes visible to the reader
+ * with one single update of the write index.
+ * @param size 1..255
+ * @return true if the record was written
+ */
+bool fifo_write_record(fifo_t* self, const uint8_t* data, uint8_t size) {
+    unsigned i = self->write_index;
+    unsigned free = self->capacity - (i - self->read_index);
+    if (size == 0 || size + 1u > free) {
+        stats_written(self, size + 1u, 0);
+        return false;
+    }
+    self->buffer[i & self->mask] = size;
+    copy_in(self, i + 1, data, size);
+    self->write_index = i + 1 + size;
+    stats_written(self, size + 1u, size + 1u);
+    return true;
+}
+
+/**
+ * Record mode: size of the data of the next record in
+ * the FIFO without the length byte, 0 if it is empty.
+ */
+unsigned fifo_get_record_size(fifo_t* self) {
+    unsigned i = self->read_index;
+    if (self->write_index == i) {
+        return 0;
+    }
+    return self->buffer[i & self->mask];
+}
@@ -11,18 +11,59 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/*
+ * Optional statistics, define FIFO_STATS to enable them:
+ *   high_water:  highest fill level ever seen
+ *   passed:      number of bytes accepted for writing
+ *   dropped:     number of bytes that did not fit and were lost
+ *   empty_polls: number of read attempts on an empty FIFO
+ */
+typedef struct {
+    volatile uint32_t high_water;
+    volatile uint32_t passed;
+    volatile uint32_t dropped;
+    volatile uint32_t empty_polls;
+} fifo_stats_t;
+
+/*
+ * The capacity must be a power of two. The read and write indices
+ * are free running and are only masked when accessing the buffer,
+ * so size = write_index - read_index is always correct, even across
+ * the unsigned overflow, and all capacity bytes can be used.
+ */
 typedef struct {
     volatile unsigned read_index;
     volatile unsigned write_index;
     volatile unsigned capacity;
+    volatile unsigned mask;
     volatile uint8_t* buffer;
+#ifdef FIFO_STATS
+    fifo_stats_t stats;
+#endif
 } fifo_t;
 
+/*
+ * Use this next to the definition of a FIFO buffer
+ * to check its size at compile time.
+ */
+#define FIFO_ASSERT_CAPACITY(buffer)                                    \
+    _Static_assert((sizeof(buffer) & (sizeof(buffer) - 1)) == 0,        \
+                   #buffer " size must be a power of two")
+
 
 void fifo_init(fifo_t* self, uint8_t* buffer, unsigned capacity);
 unsigned fifo_get_size(fifo_t* self);
+unsigned fifo_get_free(fifo_t* self);
 bool fifo_push(fifo_t* self, uint8_t byte);
 bool fifo_pop(fifo_t* self, uint8_t* byte);
+unsigned fifo_write(fifo_t* self, const uint8_t* data, unsigned count);
+unsigned fifo_read(fifo_t* self, uint8_t* data, unsigned count);
+unsigned fifo_reserve(fifo_t* self, uint8_t** data);
+void fifo_commit(fifo_t* self, unsigned count);
+unsigned fifo_peek(fifo_t* self, unsigned offset, uint8_t** data);
+void fifo_release(fifo_t* self, unsigned count);
+bool fifo_write_record(fifo_t* self, const uint8_t* data, uint8_t size);
+unsigned fifo_get_record_size(fifo_t* self);
 
 
 #endif /* SRC_USB_FIFO_H_ */
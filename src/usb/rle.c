@@ -0,0 +1,77 @@
+/*
+ * rle.c
+ *
+ *  Created on: 16.10.2026
+ *      Author: bernd
+ */
+
+#include "rle.h"
+
+/*
+ * A PackBits style run length encoding, every block starts with
+ * a control byte c:
+ *   c = 0x00..0x7f:  c + 1 literal bytes follow
+ *   c = 0x80..0xff:  the next byte is repeated c - 0x80 + 2 times
+ * Runs are only encoded from 3 bytes on, shorter ones are appended
+ * to the current block of literals. Every packet is encoded on its
+ * own, so the encoder needs no state at all and a lost packet does
+ * not affect any other packet.
+ */
+#define RLE_MAX_LITERALS    128
+#define RLE_MAX_RUN         129
+
+static uint8_t peek_byte(fifo_t* src, unsigned offset) {
+    uint8_t* data;
+    fifo_peek(src, offset, &data);
+    return *data;
+}
+
+/**
+ * Encode as many bytes from the beginning of src as will fit
+ * into size bytes of dest. The input is only looked at, the
+ * caller must fifo_release() the consumed bytes.
+ * @param consumed receives the number of input bytes encoded
+ * @return number of bytes written to dest
+ */
+unsigned rle_encode(fifo_t* src, volatile uint8_t* dest, unsigned size, unsigned* consumed) {
+    unsigned avail = fifo_get_size(src);
+    unsigned i = 0;
+    unsigned n = 0;
+    unsigned literals = 0;
+    unsigned control = 0;
+
+    while (i < avail) {
+        uint8_t b = peek_byte(src, i);
+        unsigned run = 1;
+        while (i + run < avail && run < RLE_MAX_RUN && peek_byte(src, i + run) == b) {
+            run++;
+        }
+
+        if (run >= 3) {
+            if (n + 2 > size) {
+                break;
+            }
+            dest[n++] = 0x80 + run - 2;
+            dest[n++] = b;
+            literals = 0;
+            i += run;
+            continue;
+        }
+
+        if (literals == 0 || literals == RLE_MAX_LITERALS) {
+            if (n + 2 > size) {
+                break;
+            }
+            control = n++;
+            literals = 0;
+        } else if (n + 1 > size) {
+            break;
+        }
+        dest[control] = literals++;
+        dest[n++] = b;
+        i++;
+    }
+
+    *consumed = i;
+    return n;
+}
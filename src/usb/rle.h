@@ -0,0 +1,16 @@
+/*
+ * rle.h
+ *
+ *  Created on: 16.10.2026
+ *      Author: bernd
+ */
+
+#ifndef SRC_USB_RLE_H_
+#define SRC_USB_RLE_H_
+
+#include <stdint.h>
+#include "fifo.h"
+
+unsigned rle_encode(fifo_t* src, volatile uint8_t* dest, unsigned size, unsigned* consumed);
+
+#endif /* SRC_USB_RLE_H_ */
@@ -101,7 +101,7 @@ static const uint8_t device_descriptor[18] = {
     0x01, // bNumConfigurations
 };
 
-static const uint8_t report_descriptor[28] = {
+static const uint8_t report_descriptor[36] = {
     0x05,
     0x01,
     0x09,
@@ -129,6 +129,14 @@ static const uint8_t report_descriptor[28] = {
     0x00,
     0x91,
     0x82,
+    0x75,
+    0x08,
+    0x95,
+    0x08,
+    0x09,
+    0x00,
+    0xb1,
+    0x82,
     0xc0,
 };
 
@@ -240,7 +248,7 @@ static const uint8_t configuration_descriptor[41] = {
     0x00, // bCountryCode
     0x01, // bNumDescriptors
     0x22, // bDescriptorType
-    0x1c, // wItemLength (lo)
+    0x24, // wItemLength (lo)
     0x00, // wItemLength (hi)
     0x07, // bLength (*** Endpoint ***)
     0x05, // bDescriptorType
@@ -270,3 +278,11 @@ const descriptor_table_t descriptor_table[9] ={
     {0x0200, 0x0000, &configuration_descriptor, sizeof(configuration_descriptor)},
 };
 
+static volatile uint8_t endpoint_0_rx_buf[2][64] __attribute((aligned(4)));
+static volatile uint8_t endpoint_1_rx_buf[2][64] __attribute((aligned(4)));
+
+const endpoint_table_t endpoint_table[USB_NUM_ENDPOINTS] = {
+    {0x00, ENDPOINT_IN | ENDPOINT_OUT, 64, endpoint_0_rx_buf[0], endpoint_0_handler},
+    {0x03, ENDPOINT_IN | ENDPOINT_OUT, 64, endpoint_1_rx_buf[0], stream_handler},
+};
+
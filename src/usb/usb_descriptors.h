@@ -3,7 +3,9 @@
 #ifndef USB_DESCRIPTORS_H
 #define USB_DESCRIPTORS_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct {
     uint16_t wValue;
@@ -14,4 +16,32 @@ typedef struct {
 
 extern const descriptor_table_t descriptor_table[9];
 
+#define USB_TRANSPORT_BULK 0
+#define USB_TRANSPORT_CDC 0
+#define USB_FEATURE_REPORT_SIZE 8
+#define USB_STREAM_LANES 1
+#define USB_STREAM_ENDPOINT 1
+#define USB_MESSAGE_ENDPOINT 1
+#define USB_HID_INTERFACES 1
+#define USB_NUM_ENDPOINTS 2
+#define ENDPOINT_IN 0x01
+#define ENDPOINT_OUT 0x02
+
+struct buffer_descriptor;
+
+typedef bool (*endpoint_handler_t)(uint8_t tok, struct buffer_descriptor* buf_desc);
+
+typedef struct {
+    uint8_t type;
+    uint8_t direction;
+    uint16_t size;
+    volatile uint8_t* rx_buf;
+    endpoint_handler_t handler;
+} endpoint_table_t;
+
+extern const endpoint_table_t endpoint_table[USB_NUM_ENDPOINTS];
+
+bool endpoint_0_handler(uint8_t tok, struct buffer_descriptor* buf_desc);
+bool stream_handler(uint8_t tok, struct buffer_descriptor* buf_desc);
+
 #endif
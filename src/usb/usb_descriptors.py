@@ -8,6 +8,20 @@ Created on 11.11.2016
 
 
 def generate(f):
+    # The stream can either be tunneled over HID (the default, needs
+    # no driver) or use a vendor specific interface with a pair of
+    # bulk endpoints for much higher throughput (needs WinUSB or
+    # libusb on the host), or use a composite device with the HID
+    # interface for the message packets only and a CDC-ACM serial
+    # port for the stream. Select with USB_TRANSPORT=hid|bulk|cdc
+    # in the environment when running this script.
+    transport = os.environ.get("USB_TRANSPORT", "hid")
+    if transport not in ("hid", "bulk", "cdc"):
+        print("ERROR: USB_TRANSPORT must be hid, bulk or cdc")
+        exit(1)
+    gen_define("USB_TRANSPORT_BULK", 1 if transport in ("bulk", "cdc") else 0)
+    gen_define("USB_TRANSPORT_CDC", 1 if transport == "cdc" else 0)
+
     gen_device_descriptor(
         f,                  # file handle
         0xdead,             # idVendor
@@ -15,58 +29,253 @@ def generate(f):
         0x0000,             # bcdDevice
         "ACME Inc.",        # vendor name
         "Demo Device",      # device name
-        "00000000"          # serial number (place holder)
+        "00000000",         # serial number (place holder)
+        transport == "bulk",# have a BOS descriptor (needs USB 2.1)
+        transport == "cdc"  # have interface association descriptors
     )
 
-    gen_report_descriptor(
-        f,
-        0x05, 0x01,         # USAGE_PAGE (Generic Desktop)
-        0x09, 0x00,         # USAGE (Undefined)
-        0xa1, 0x01,         # COLLECTION (Application)
-        0x15, 0x00,         # LOGICAL_MINIMUM (0)
-        0x26, 0xff, 0x00,   # LOGICAL_MAXIMUM (255)
-        0x75, 0x08,         # REPORT_SIZE (8)
-        0x95, 0x40,         # REPORT_COUNT (64)
-        0x09, 0x00,         # USAGE (Undefined)
-        0x81, 0x82,         # INPUT (Data,Var,Abs,Vol) - to the host
-        0x75, 0x08,         # REPORT_SIZE (8)
-        0x95, 0x40,         # REPORT_COUNT (64)
-        0x09, 0x00,         # USAGE (Undefined)
-        0x91, 0x82,         # OUTPUT (Data,Var,Abs,Vol) - from the host
-        0xc0                # END_COLLECTION
-    )
+    if transport != "bulk":
+        # the feature report carries the configuration and status of
+        # the driver over EP0, see get_feature_report() in usb_device.c
+        gen_define("USB_FEATURE_REPORT_SIZE", 8)
+        gen_report_descriptor(
+            f,
+            0x05, 0x01,         # USAGE_PAGE (Generic Desktop)
+            0x09, 0x00,         # USAGE (Undefined)
+            0xa1, 0x01,         # COLLECTION (Application)
+            0x15, 0x00,         # LOGICAL_MINIMUM (0)
+            0x26, 0xff, 0x00,   # LOGICAL_MAXIMUM (255)
+            0x75, 0x08,         # REPORT_SIZE (8)
+            0x95, 0x40,         # REPORT_COUNT (64)
+            0x09, 0x00,         # USAGE (Undefined)
+            0x81, 0x82,         # INPUT (Data,Var,Abs,Vol) - to the host
+            0x75, 0x08,         # REPORT_SIZE (8)
+            0x95, 0x40,         # REPORT_COUNT (64)
+            0x09, 0x00,         # USAGE (Undefined)
+            0x91, 0x82,         # OUTPUT (Data,Var,Abs,Vol) - from the host
+            0x75, 0x08,         # REPORT_SIZE (8)
+            0x95, 0x08,         # REPORT_COUNT (8)
+            0x09, 0x00,         # USAGE (Undefined)
+            0xb1, 0x82,         # FEATURE (Data,Var,Abs,Vol) - over EP0
+            0xc0                # END_COLLECTION
+        )
 
-    gen_config_descriptor(
-        f,                          # file handle
-        "Default Configuration",    # iConfiguration
-        0x80,                       # bmAttributes
-        250,                        # bMaxPower
-        interface(
+    if transport == "bulk":
+        gen_define("USB_STREAM_LANES", 1)
+        gen_define("USB_STREAM_ENDPOINT", 1)
+        gen_define("USB_HID_INTERFACES", 0)
+        interfaces = [interface(
             0,                      # iInterfaceNumber
+            0xff,                   # bInterfaceClass (vendor specific)
+            0,                      # bInterfaceSubClass
+            0,                      # bInterfaceProtocol
+            "Stream over Bulk",     # iInterface
+
+            endpoint(
+                0x81,               # bEndpointAddr
+                0x02,               # bmAttributes
+                64,                 # wMaxPacketSize
+                0,                  # bInterval
+                "stream_handler"    # handler in usb_device.c
+            ),
+
+            endpoint(
+                0x01,               # bEndpointAddr
+                0x02,               # bmAttributes
+                64,                 # wMaxPacketSize
+                0,                  # bInterval
+                "stream_handler"    # handler in usb_device.c
+            ),
+        )]
+
+    elif transport == "cdc":
+        gen_define("USB_STREAM_LANES", 1)
+        gen_define("USB_STREAM_ENDPOINT", 3)
+        gen_define("USB_MESSAGE_ENDPOINT", 1)
+        gen_define("USB_HID_INTERFACES", 1)
+        interfaces = [
+            interface(
+                0,                      # iInterfaceNumber
+                3,                      # bInterfaceClass
+                0,                      # bInterfaceSubClass
+                0,                      # bInterfaceProtocol
+                "Messages over HID",    # iInterface
+
+                hid(0),                 # insert a HID descriptor here
+
+                endpoint(
+                    0x81,               # bEndpointAddr
+                    0x03,               # bmAttributes
+                    64,                 # wMaxPacketSize
+                    1,                  # bInterval
+                    "message_handler"   # handler in usb_device.c
+                ),
+
+                endpoint(
+                    0x01,               # bEndpointAddr
+                    0x03,               # bmAttributes
+                    64,                 # wMaxPacketSize
+                    1,                  # bInterval
+                    "message_handler"   # handler in usb_device.c
+                ),
+            ),
+
+            interface_association(
+                1,                      # bFirstInterface
+                2,                      # bInterfaceCount
+                2,                      # bFunctionClass (CDC)
+                2,                      # bFunctionSubClass (ACM)
+                1,                      # bFunctionProtocol (AT commands)
+                "Stream over CDC"       # iFunction
+            ),
+
+            interface(
+                1,                      # iInterfaceNumber
+                2,                      # bInterfaceClass (CDC)
+                2,                      # bInterfaceSubClass (ACM)
+                1,                      # bInterfaceProtocol (AT commands)
+                "Stream over CDC",      # iInterface
+
+                cdc_acm(1, 2),          # insert the CDC functional descriptors
+
+                endpoint(
+                    0x82,               # bEndpointAddr
+                    0x03,               # bmAttributes
+                    16,                 # wMaxPacketSize
+                    16,                 # bInterval
+                    None                # notifications are never sent
+                ),
+            ),
+
+            interface(
+                2,                      # iInterfaceNumber
+                0x0a,                   # bInterfaceClass (CDC data)
+                0,                      # bInterfaceSubClass
+                0,                      # bInterfaceProtocol
+                "Stream over CDC",      # iInterface
+
+                endpoint(
+                    0x83,               # bEndpointAddr
+                    0x02,               # bmAttributes
+                    64,                 # wMaxPacketSize
+                    0,                  # bInterval
+                    "stream_handler"    # handler in usb_device.c
+                ),
+
+                endpoint(
+                    0x03,               # bEndpointAddr
+                    0x02,               # bmAttributes
+                    64,                 # wMaxPacketSize
+                    0,                  # bInterval
+                    "stream_handler"    # handler in usb_device.c
+                ),
+            ),
+        ]
+
+    else:
+        # Optionally the stream can be striped across several HID
+        # interfaces (lanes) with one pair of interrupt endpoints each,
+        # to multiply the throughput. Select with USB_STREAM_LANES=n
+        # in the environment when running this script (1, 2 or 4).
+        lanes = int(os.environ.get("USB_STREAM_LANES", "1"))
+        if lanes not in (1, 2, 4):
+            print("ERROR: USB_STREAM_LANES must be 1, 2 or 4")
+            exit(1)
+        gen_define("USB_STREAM_LANES", lanes)
+        gen_define("USB_STREAM_ENDPOINT", 1)
+        gen_define("USB_MESSAGE_ENDPOINT", 1)
+        gen_define("USB_HID_INTERFACES", lanes)
+
+        interfaces = [interface(
+            lane,                   # iInterfaceNumber
             3,                      # bInterfaceClass
             0,                      # bInterfaceSubClass
             0,                      # bInterfaceProtocol
             "Stream over HID",      # iInterface
 
-            hid(),                  # insert a HID descriptor here
+            hid(lane),              # insert a HID descriptor here
 
             endpoint(
-                0x81,               # bEndpointAddr
+                0x81 + lane,        # bEndpointAddr
                 0x03,               # bmAttributes
                 64,                 # wMaxPacketSize
-                1                   # bInterval
+                1,                  # bInterval
+                "stream_handler"    # handler in usb_device.c
             ),
 
             endpoint(
-                0x01,               # bEndpointAddr
+                0x01 + lane,        # bEndpointAddr
                 0x03,               # bmAttributes
                 64,                 # wMaxPacketSize
-                1                   # bInterval
+                1,                  # bInterval
+                "stream_handler"    # handler in usb_device.c
             ),
-        )
+        ) for lane in range(lanes)]
+
+    # Optionally add an interface with an isochronous IN endpoint for
+    # constant rate data, it is only active in alternate setting 1.
+    # Select with USB_ISO_PACKET_SIZE=n in the environment when
+    # running this script (64, 128, 256 or 512, default 0 = none).
+    iso_size = int(os.environ.get("USB_ISO_PACKET_SIZE", "0"))
+    if iso_size not in (0, 64, 128, 256, 512):
+        print("ERROR: USB_ISO_PACKET_SIZE must be 0, 64, 128, 256 or 512")
+        exit(1)
+    if iso_size:
+        iso_interface = len([i for i in interfaces if i[1][0] == 4])
+        iso_endpoint = num_endpoints()
+        gen_define("USB_ISO_INTERFACE", iso_interface)
+        gen_define("USB_ISO_ENDPOINT", iso_endpoint)
+        gen_define("USB_ISO_PACKET_SIZE", iso_size)
+        interfaces += [
+            interface(
+                iso_interface,          # iInterfaceNumber
+                0xff,                   # bInterfaceClass (vendor specific)
+                0,                      # bInterfaceSubClass
+                0,                      # bInterfaceProtocol
+                "Isochronous Stream",   # iInterface
+            ),
+
+            interface(
+                iso_interface,          # iInterfaceNumber
+                0xff,                   # bInterfaceClass (vendor specific)
+                0,                      # bInterfaceSubClass
+                0,                      # bInterfaceProtocol
+                "Isochronous Stream",   # iInterface
+
+                endpoint(
+                    0x80 + iso_endpoint,# bEndpointAddr
+                    0x05,               # bmAttributes (isochronous, asynchronous)
+                    iso_size,           # wMaxPacketSize
+                    1,                  # bInterval
+                    "iso_handler"       # handler in usb_device.c
+                ),
+
+                bAlternateSetting=1
+            ),
+        ]
+
+    gen_config_descriptor(
+        f,                          # file handle
+        "Default Configuration",    # iConfiguration
+        0x80,                       # bmAttributes
+        250,                        # bMaxPower
+        *interfaces
     )
 
+    if transport == "bulk":
+        # Windows 8.1 and newer will then bind WinUSB to the bulk
+        # interface automatically, no driver installation needed.
+        gen_bos_descriptor(
+            f,                      # file handle
+            ms_os_20(
+                f,                  # file handle
+                0x01,               # bMS_VendorCode
+                "{8F5A2B46-3C1D-4E7A-9B0E-6D2C4F1A7E35}"  # DeviceInterfaceGUID
+            )
+        )
+
     gen_descriptor_table(f)
+    gen_endpoint_table(f)
 
 
 #
@@ -79,9 +288,14 @@ import sys
 STRING_INDEX = 0
 REP_DESC_LEN = 0
 DESCR_TBL = []
+EP0_SIZE = 64
+ENDPOINTS = {}
+STRINGS = {}
+DEFINES = []
 
 
-def interface(iInterfaceNumber, bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol, sInterface, *args):
+def interface(iInterfaceNumber, bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol, sInterface, *args,
+              bAlternateSetting=0):
     bNumEndpoints = 0
     for arg in args:
         if arg[1][0] == 5:
@@ -89,7 +303,7 @@ def interface(iInterfaceNumber, bInterfaceClass, bInterfaceSubClass, bInterfaceP
     members = [(9, "bLength (*** Interface ***"),
                (4, "bDescriptorType"),
                (iInterfaceNumber, "iInterfaceNumber"),
-               (0, "bAlternateSetting"),
+               (bAlternateSetting, "bAlternateSetting"),
                (bNumEndpoints, "bNumEndpoints"),
                (bInterfaceClass, "bInterfaceClass"),
                (bInterfaceSubClass, "bInterfaceSubClass"),
@@ -100,7 +314,8 @@ def interface(iInterfaceNumber, bInterfaceClass, bInterfaceSubClass, bInterfaceP
     return members
 
 
-def endpoint(bEndpointAddr, bmAttributes, wMaxPacketSize, bInterval):
+def endpoint(bEndpointAddr, bmAttributes, wMaxPacketSize, bInterval, handler):
+    add_endpoint(bEndpointAddr, bmAttributes, wMaxPacketSize, handler)
     members = [(7, "bLength (*** Endpoint ***)"),
                (5, "bDescriptorType"),
                (bEndpointAddr, "bEndpointAddr"),
@@ -111,8 +326,46 @@ def endpoint(bEndpointAddr, bmAttributes, wMaxPacketSize, bInterval):
     return members
 
 
-def hid():
+def interface_association(bFirstInterface, bInterfaceCount, bFunctionClass, bFunctionSubClass, bFunctionProtocol, sFunction):
+    members = [(8, "bLength (*** Interface Association ***)"),
+               (0x0b, "bDescriptorType"),
+               (bFirstInterface, "bFirstInterface"),
+               (bInterfaceCount, "bInterfaceCount"),
+               (bFunctionClass, "bFunctionClass"),
+               (bFunctionSubClass, "bFunctionSubClass"),
+               (bFunctionProtocol, "bFunctionProtocol"),
+               make_string(sFunction, "iFunction")]
+    return members
+
+
+def cdc_acm(iControlInterface, iDataInterface):
+    bcdCDC = 0x0110
+    members = [(5, "bLength (*** CDC Header ***)"),
+               (0x24, "bDescriptorType (CS_INTERFACE)"),
+               (0x00, "bDescriptorSubtype"),
+               (lo(bcdCDC), "bcdCDC (lo)"),
+               (hi(bcdCDC), "bcdCDC (hi)"),
+               (5, "bLength (*** CDC Call Management ***)"),
+               (0x24, "bDescriptorType (CS_INTERFACE)"),
+               (0x01, "bDescriptorSubtype"),
+               (0x00, "bmCapabilities"),
+               (iDataInterface, "bDataInterface"),
+               (4, "bLength (*** CDC ACM ***)"),
+               (0x24, "bDescriptorType (CS_INTERFACE)"),
+               (0x02, "bDescriptorSubtype"),
+               (0x02, "bmCapabilities (line coding and state)"),
+               (5, "bLength (*** CDC Union ***)"),
+               (0x24, "bDescriptorType (CS_INTERFACE)"),
+               (0x06, "bDescriptorSubtype"),
+               (iControlInterface, "bControlInterface"),
+               (iDataInterface, "bSubordinateInterface0")]
+    return members
+
+
+def hid(iInterfaceNumber):
     global REP_DESC_LEN
+    if iInterfaceNumber > 0:
+        DESCR_TBL.append((0x2200, iInterfaceNumber, "report_descriptor"))
     bcdHid = 0x0101
     members = [(9, "bLength (*** HID-Descriptor ***"),
                (0x21, "bDescriptorType"),
@@ -131,7 +384,7 @@ def gen_config_descriptor(f, sConfiguration, bmAttributes, bMaxPower, *args):
     bNumInterfaces = 0
     for arg in args:
         wTotalLength += len(arg)
-        if arg[1][0] == 4:
+        if arg[1][0] == 4 and arg[3][0] == 0:
             bNumInterfaces += 1
 
     members = [(9, "bLength (*** Configuration ***"),
@@ -159,16 +412,19 @@ def gen_report_descriptor(f, *args):
     REP_DESC_LEN = len(members)
 
 
-def gen_device_descriptor(f, idVendor, idProduct, bcdDevice, sManufacturer, sProduct, sSerial):
-    bcdUSB = 0x0101
+def gen_device_descriptor(f, idVendor, idProduct, bcdDevice, sManufacturer, sProduct, sSerial, bos=False, iad=False):
+    # the host will only ask for the BOS descriptor from USB 2.1 devices
+    bcdUSB = 0x0210 if bos else 0x0101
+    # devices with interface association descriptors must say so here
+    bDeviceClass, bDeviceSubClass, bDeviceProtocol = (0xef, 0x02, 0x01) if iad else (0, 0, 0)
     members = [(18, "bLength"),
                (1, "bDescriptorType"),
                (lo(bcdUSB), 'bcdUSB (lo)'),
                (hi(bcdUSB), 'bcdUSB (hi)'),
-               (0, 'bDeviceClass'),
-               (0, 'bDeviceSubClass'),
-               (0, 'bDeviceProtocol'),
-               (64, 'bMaxPacketSize'),
+               (bDeviceClass, 'bDeviceClass'),
+               (bDeviceSubClass, 'bDeviceSubClass'),
+               (bDeviceProtocol, 'bDeviceProtocol'),
+               (EP0_SIZE, 'bMaxPacketSize'),
                (lo(idVendor), 'idVendor (lo)'),
                (hi(idVendor), 'idVendor (hi)'),
                (lo(idProduct), 'idProduct (lo)'),
@@ -183,6 +439,80 @@ def gen_device_descriptor(f, idVendor, idProduct, bcdDevice, sManufacturer, sPro
     DESCR_TBL.append((0x100, 0, "device_descriptor"))
 
 
+def gen_bos_descriptor(f, *args):
+    wTotalLength = 5
+    for arg in args:
+        wTotalLength += len(arg)
+    members = [(5, "bLength (*** BOS ***)"),
+               (0x0f, "bDescriptorType"),
+               (lo(wTotalLength), "wTotalLength (lo)"),
+               (hi(wTotalLength), "wTotalLength (hi)"),
+               (len(args), "bNumDeviceCaps")]
+    for arg in args:
+        members.extend(arg)
+    gen_array(f, "bos_descriptor", members)
+    DESCR_TBL.append((0x0f00, 0, "bos_descriptor"))
+
+
+def ms_os_20(f, bVendorCode, sDeviceInterfaceGUID):
+    # Generates the Microsoft OS 2.0 descriptor set for a single
+    # interface device, it is fetched by the host with a vendor
+    # request (bRequest = bVendorCode, wIndex = 7) which the
+    # firmware answers from the descriptor table with wValue = 0.
+    # Returns the platform capability descriptor for the BOS.
+    dwWindowsVersion = 0x06030000
+    name = utf16("DeviceInterfaceGUIDs\0")
+    data = utf16(sDeviceInterfaceGUID + "\0\0")
+    wPropertyLength = 10 + len(name) + len(data)
+    wTotalLength = 10 + 20 + wPropertyLength
+    members = [(10, "wLength (lo) (*** MS OS 2.0 Set Header ***)"),
+               (0, "wLength (hi)"),
+               (0x00, "wDescriptorType (lo)"),
+               (0x00, "wDescriptorType (hi)")]
+    members.extend(dword(dwWindowsVersion, "dwWindowsVersion"))
+    members.extend([(lo(wTotalLength), "wTotalLength (lo)"),
+                    (hi(wTotalLength), "wTotalLength (hi)"),
+                    (20, "wLength (lo) (*** MS OS 2.0 Compatible ID ***)"),
+                    (0, "wLength (hi)"),
+                    (0x03, "wDescriptorType (lo)"),
+                    (0x00, "wDescriptorType (hi)")])
+    for c in "WINUSB\0\0":
+        members.append((ord(c), "CompatibleID \"{}\"".format(c) if c != "\0" else "CompatibleID"))
+    for i in range(8):
+        members.append((0, "SubCompatibleID"))
+    members.extend([(lo(wPropertyLength), "wLength (lo) (*** MS OS 2.0 Registry Property ***)"),
+                    (hi(wPropertyLength), "wLength (hi)"),
+                    (0x04, "wDescriptorType (lo)"),
+                    (0x00, "wDescriptorType (hi)"),
+                    (0x07, "wPropertyDataType (lo) REG_MULTI_SZ"),
+                    (0x00, "wPropertyDataType (hi)"),
+                    (lo(len(name)), "wPropertyNameLength (lo)"),
+                    (hi(len(name)), "wPropertyNameLength (hi)")])
+    members.extend(name)
+    members.extend([(lo(len(data)), "wPropertyDataLength (lo)"),
+                    (hi(len(data)), "wPropertyDataLength (hi)")])
+    members.extend(data)
+    gen_array(f, "ms_os_20_descriptor_set", members)
+    DESCR_TBL.append((0x0000, 0x0007, "ms_os_20_descriptor_set"))
+    gen_define("USB_MS_OS_20_VENDOR_CODE", "0x{:02x}".format(bVendorCode))
+
+    # {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}
+    uuid = [0xdf, 0x60, 0xdd, 0xd8, 0x89, 0x45, 0xc7, 0x4c,
+            0x9c, 0xd2, 0x65, 0x9d, 0x9e, 0x64, 0x8a, 0x9f]
+    members = [(28, "bLength (*** Platform Capability ***)"),
+               (0x10, "bDescriptorType"),
+               (0x05, "bDevCapabilityType"),
+               (0, "bReserved")]
+    for b in uuid:
+        members.append((b, "PlatformCapabilityUUID"))
+    members.extend(dword(dwWindowsVersion, "dwWindowsVersion"))
+    members.extend([(lo(wTotalLength), "wMSOSDescriptorSetTotalLength (lo)"),
+                    (hi(wTotalLength), "wMSOSDescriptorSetTotalLength (hi)"),
+                    (bVendorCode, "bMS_VendorCode"),
+                    (0, "bAltEnumCode")])
+    return members
+
+
 def gen_string_descriptor(f, value):
     global STRING_INDEX
     if STRING_INDEX == 0:
@@ -209,6 +539,46 @@ def gen_lang_descriptor(f):
     STRING_INDEX = 1
 
 
+def add_endpoint(bEndpointAddr, bmAttributes, wMaxPacketSize, handler):
+    # IN and OUT of the same endpoint number share one
+    # entry in the endpoint table and also one handler
+    num = bEndpointAddr & 0x0f
+    ep = ENDPOINTS.setdefault(num, {"type": bmAttributes & 0x03,
+                                    "dir": set(),
+                                    "size": 0,
+                                    "handler": handler})
+    if ep["handler"] != handler or ep["type"] != bmAttributes & 0x03:
+        print("ERROR: IN and OUT of endpoint {} must have the same type and handler".format(num))
+        exit(1)
+    ep["dir"].add("ENDPOINT_IN" if bEndpointAddr & 0x80 else "ENDPOINT_OUT")
+    ep["size"] = max(ep["size"], wMaxPacketSize)
+
+
+def num_endpoints():
+    return max(ENDPOINTS.keys()) + 1
+
+
+def gen_endpoint_table(f):
+    add_endpoint(0x80, 0x00, EP0_SIZE, "endpoint_0_handler")
+    add_endpoint(0x00, 0x00, EP0_SIZE, "endpoint_0_handler")
+    for num in sorted(ENDPOINTS):
+        ep = ENDPOINTS[num]
+        if "ENDPOINT_OUT" in ep["dir"]:
+            f.write("static volatile uint8_t endpoint_{}_rx_buf[2][{}] __attribute((aligned(4)));\n".format(num, ep["size"]))
+    f.write("\n")
+
+    f.write("const endpoint_table_t endpoint_table[USB_NUM_ENDPOINTS] = {\n")
+    for num in range(num_endpoints()):
+        if num in ENDPOINTS:
+            ep = ENDPOINTS[num]
+            rx_buf = "endpoint_{}_rx_buf[0]".format(num) if "ENDPOINT_OUT" in ep["dir"] else "NULL"
+            f.write("    {{0x{:02x}, {}, {}, {}, {}}},\n".format(ep["type"], " | ".join(sorted(ep["dir"])),
+                                                              ep["size"], rx_buf, ep["handler"] or "NULL"))
+        else:
+            f.write("    {0x00, 0, 0, NULL, NULL},\n")
+    f.write("};\n\n")
+
+
 def gen_descriptor_table(f):
     f.write("const descriptor_table_t descriptor_table[{}] ={{\n".format(len(DESCR_TBL)))
     for item in DESCR_TBL:
@@ -223,12 +593,19 @@ def gen_descriptor_table(f):
 
 def make_string(string, comment):
     if string != "":
-        gen_string_descriptor(f, string)
-        return (STRING_INDEX - 1, "{} \"{}\"".format(comment, string))
+        if string not in STRINGS:
+            gen_string_descriptor(f, string)
+            STRINGS[string] = STRING_INDEX - 1
+        return (STRINGS[string], "{} \"{}\"".format(comment, string))
     else:
         return (0, comment + "{} (0 = empty)".format(comment))
 
 
+def gen_define(name, value):
+    # configuration values that are needed in the C code
+    DEFINES.append((name, value))
+
+
 def gen_array(f, name, members):
     f.write("static const uint8_t {}[{}] = {{\n".format(name, len(members)))
     for member in members:
@@ -246,7 +623,9 @@ def gen_header_file():
     f.write("#ifndef USB_DESCRIPTORS_H\n")
     f.write("#define USB_DESCRIPTORS_H\n\n")
 
-    f.write("#include <stdint.h>\n\n")
+    f.write("#include <stddef.h>\n")
+    f.write("#include <stdint.h>\n")
+    f.write("#include <stdbool.h>\n\n")
 
     f.write("typedef struct {\n")
     f.write("    uint16_t wValue;\n")
@@ -257,10 +636,48 @@ def gen_header_file():
 
     f.write("extern const descriptor_table_t descriptor_table[{}];\n\n".format(len(DESCR_TBL)))
 
+    for (name, value) in DEFINES:
+        f.write("#define {} {}\n".format(name, value))
+    f.write("#define USB_NUM_ENDPOINTS {}\n".format(num_endpoints()))
+    f.write("#define ENDPOINT_IN 0x01\n")
+    f.write("#define ENDPOINT_OUT 0x02\n\n")
+
+    f.write("struct buffer_descriptor;\n\n")
+    f.write("typedef bool (*endpoint_handler_t)(uint8_t tok, struct buffer_descriptor* buf_desc);\n\n")
+
+    f.write("typedef struct {\n")
+    f.write("    uint8_t type;\n")
+    f.write("    uint8_t direction;\n")
+    f.write("    uint16_t size;\n")
+    f.write("    volatile uint8_t* rx_buf;\n")
+    f.write("    endpoint_handler_t handler;\n")
+    f.write("} endpoint_table_t;\n\n")
+
+    f.write("extern const endpoint_table_t endpoint_table[USB_NUM_ENDPOINTS];\n\n")
+
+    for handler in sorted(set(ep["handler"] for ep in ENDPOINTS.values() if ep["handler"])):
+        f.write("bool {}(uint8_t tok, struct buffer_descriptor* buf_desc);\n".format(handler))
+    f.write("\n")
+
     f.write("#endif\n")
     f.close()
 
 
+def utf16(string):
+    members = []
+    for c in string:
+        members.append((ord(c), "UTF-16-LE: \"{}\"".format(c) if c != "\0" else "UTF-16-LE: NUL"))
+        members.append((0, ''))
+    return members
+
+
+def dword(value, comment):
+    return [(value & 0xff, comment + " (byte 0)"),
+            ((value >> 8) & 0xff, comment + " (byte 1)"),
+            ((value >> 16) & 0xff, comment + " (byte 2)"),
+            ((value >> 24) & 0xff, comment + " (byte 3)")]
+
+
 def lo(word):
     return word & 0xff
 
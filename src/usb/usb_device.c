@@ -16,6 +16,31 @@
  * transmitted outside the stream and with higher priority,
  * this can be used for arbitrary control and status purposes.
  *
+ * The stream can also be split into USB_CHANNELS virtual channels
+ * with their own FIFOs, every packet then carries the channel
+ * number and the channels are served by a weighted round robin.
+ *
+ * With USB_STREAM_COMPRESS the IN stream packets can be run length
+ * encoded, this is negotiated by the host with a driver packet.
+ *
+ * With USB_STREAM_TIMESTAMP every IN packet tells when it was sent
+ * and for how many frames it had been queued before.
+ *
+ * Alternatively (USB_TRANSPORT=bulk when generating the
+ * descriptors) the same stream is carried over a vendor specific
+ * interface with a pair of bulk endpoints, for much higher
+ * throughput at the cost of needing WinUSB or libusb on the host.
+ * The bulk pipe carries only the raw stream bytes without any
+ * framing, message packets and records are not available then.
+ *
+ * The third option (USB_TRANSPORT=cdc) is a composite device: the
+ * HID interface on EP1 only carries the message packets and the
+ * stream goes over the bulk endpoints of a CDC-ACM serial port.
+ *
+ * With USB_ISO_PACKET_SIZE set there is also an isochronous IN
+ * endpoint for constant rate data (usb_iso), it has guaranteed
+ * bandwidth but no retransmission and no flow control.
+ *
  * Created on: 02.11.2016
  *     Author: Bernd Kreuss
  *
@@ -25,13 +50,53 @@
  */
 
 #include <stddef.h>
+#include <string.h>
 #include <MKL25Z4.h>
 
 #include "usb_device.h"
 #include "fifo.h"
+#include "crc8.h"
+#include "rle.h"
+
+#define ENDPOINT_BUF_SIZE               USB_PACKET_SIZE
+#define TX_PACKET_SLOTS                 (2 * USB_STREAM_LANES)
+#define STREAM_ENDPOINT(lane)           (USB_STREAM_ENDPOINT + (lane))
+
+#if USB_TRANSPORT_BULK
+#define STREAM_RX_PAYLOAD_SIZE          ENDPOINT_BUF_SIZE
+#else
+#define STREAM_RX_PAYLOAD_SIZE          USB_PACKET_PAYLOAD_SIZE
+#endif
 
-#define ENDPOINT_BUF_SIZE               64
-#define USB_NUM_ENDPOINTS               2
+#ifndef USB_MESSAGE_SLOTS
+#define USB_MESSAGE_SLOTS               4
+#endif
+
+#ifndef USB_CHANNEL_FIFO_SIZE
+#define USB_CHANNEL_FIFO_SIZE           512
+#endif
+
+#if USB_TRANSPORT_BULK && USB_CHANNELS > 1
+#error "virtual channels need the HID framing"
+#endif
+
+#if USB_TRANSPORT_BULK && defined(USB_STREAM_CHECK)
+#error "USB_STREAM_CHECK needs the HID framing"
+#endif
+
+#if USB_TRANSPORT_BULK && defined(USB_STREAM_COMPRESS)
+#error "USB_STREAM_COMPRESS needs the HID framing"
+#endif
+
+#if USB_TRANSPORT_BULK && defined(USB_STREAM_TIMESTAMP)
+#error "USB_STREAM_TIMESTAMP needs the HID framing"
+#endif
+
+#ifndef USB_ISO_FRAME_SLOTS
+#define USB_ISO_FRAME_SLOTS             4
+#endif
+
+#define ENDPOINT_TYPE_ISOCHRONOUS       0x1
 
 #define TOK_OUT                         0x1
 #define TOK_IN                          0x9
@@ -52,16 +117,33 @@
 #define BD_NINC_MASK                    (1 << 4)
 #define BD_DTS_MASK                     (1 << 3)
 #define BD_STALL_MASK                   (1 << 2)
-#define BDT_INDEX(endpoint, tx, odd)    ((endpoint << 2) | (tx << 1) | odd)
+#define BDT_INDEX(endpoint, tx, odd)    (((endpoint) << 2) | ((tx) << 1) | (odd))
 #define BD_GET_TOK(desc)                ((desc >> 2) & 0xF)
 #define BD_OWNED_BY_USB(count, data1)   ((count << BD_BC_SHIFT) | BD_OWN_MASK | (data1 ? BD_DATA1_MASK : 0x00) | BD_DTS_MASK)
 
 #define REPORT_ID_RX                    2
 #define REPORT_ID_TX                    1
 #define MAGIC_MESSAGE_PACKET            0xff
+#define MAGIC_DRIVER_PACKET             0xfe
+#define MAGIC_RECORD_PACKET             0xfd
+#define COMPRESSED_PACKET_FLAG          0x40
+#define COMPRESSED_PACKET(size)         (((size) & 0xc0) == COMPRESSED_PACKET_FLAG)
+
+#define DRV_CMD_GET_STATS               0x01
+#define DRV_CMD_SET_TX_POLICY           0x02
+#define DRV_CMD_SET_SHORT_PACKETS       0x03
+#define DRV_CMD_SET_CHANNEL_WEIGHT      0x04
+#define DRV_CMD_CREDIT                  0x05
+#define DRV_CMD_GET_CHECK_STATS         0x06
+#define DRV_CMD_SET_COMPRESSION         0x07
+#define CDC_LINE_CODING_SIZE            7
+
+#define DRV_OK                          0x00
+#define DRV_UNSUPPORTED                 0x01
 
 #define WEAK                            __attribute((weak))
 #define ALIGN512                        __attribute((aligned(512)))
+#define ALIGN4                          __attribute((aligned(4)))
 
 
 /**
@@ -75,71 +157,242 @@
  * and even the bytes pointed to at any time, therefore
  * they are all declared as volatile.
  */
-typedef struct {
+typedef struct buffer_descriptor {
     volatile uint32_t desc;
     volatile void* volatile addr;
 } buffer_descriptor_t;
 
-/**
- * The double buffered endpoint buffers holding the data for transmission
- * or receiving the data. This type is used for RX and TX buffers, all of
- * them can be read or written either by the the USB-DMA or the application,
- * therefore all their contents are declared as volatile.
+typedef struct {
+    uint8_t tx_odd;
+    uint8_t tx_data1;
+} endpoint_state_t;
+
+static endpoint_state_t endpoint_state[USB_NUM_ENDPOINTS] = {};
+
+
+/*
+ * The queue of outgoing message packets (and driver packets), a
+ * ring of USB_MESSAGE_SLOTS complete reports. Just like the TX ring
+ * below the buffer descriptors point directly into the slots and a
+ * slot is released when its TOK_IN has completed.
  */
-typedef volatile uint8_t usb_endpoint_buffer_t[2][ENDPOINT_BUF_SIZE];
+ALIGN4 static uint8_t tx_message_buf[USB_MESSAGE_SLOTS * ENDPOINT_BUF_SIZE];
+FIFO_ASSERT_CAPACITY(tx_message_buf);
+static fifo_t tx_messages;
+static volatile uint8_t tx_messages_in_flight = 0;
 
-/**
- * Structure of a SETUP packet, used by endpoint 0
+/*
+ * Incoming message packets are copied into this queue by the
+ * ISR and are then fetched by the application from main context
+ * with usb_poll_message(), the ISR does not need to wait for
+ * the application to handle them.
  */
-typedef struct {
-    union {
-        struct {
-            uint8_t bmRequestType;
-            uint8_t bRequest;
-        };
-        uint16_t wRequestAndType;
-    };
-    uint16_t wValue;
-    uint16_t wIndex;
-    uint16_t wLength;
-} setup_t;
+ALIGN4 static uint8_t rx_message_buf[USB_MESSAGE_SLOTS * ENDPOINT_BUF_SIZE];
+FIFO_ASSERT_CAPACITY(rx_message_buf);
+static fifo_t rx_messages;
 
-/**
- * Our hid report packets always include a payload size member
- * because due to a bug in the generic Windows HID driver it
- * will always either send a full sized packet or no packet at
- * all, no matter the actual byte count to transmit.
+/*
+ * The stream FIFOs of all channels, usb_tx and usb_rx
+ * are just other names for the ones of channel 0.
  */
-typedef volatile struct {
-    uint8_t payload_size;
-    uint8_t payload_data[];
-} hid_packet_header_t;
+static uint8_t tx_fifo_buf[USB_CHANNELS][USB_CHANNEL_FIFO_SIZE] = {};
+static uint8_t rx_fifo_buf[USB_CHANNELS][USB_CHANNEL_FIFO_SIZE] = {};
+FIFO_ASSERT_CAPACITY(tx_fifo_buf[0]);
+FIFO_ASSERT_CAPACITY(rx_fifo_buf[0]);
 
-typedef struct {
-    uint8_t tx_odd;
-    uint8_t tx_data1;
-} endpoint_state_t;
+fifo_t usb_rx_channel[USB_CHANNELS];
+fifo_t usb_tx_channel[USB_CHANNELS];
 
-typedef enum {
-    MSG_QUEUED,
-    MSG_TRANSMITTING,
-    MSG_FREE
-} message_packet_state_t;
+/*
+ * The packet framed TX ring for the stream endpoints. Complete reports
+ * (header + payload) are assembled in place in these slots and
+ * the buffer descriptors point directly into them, a slot is
+ * released when its TOK_IN has completed. There are two slots per
+ * lane, one for each of the ping-pong TX buffer descriptors, this
+ * costs as much RAM as the two 64 byte buffers it replaces.
+ * tx_packet_reserved is set while the application is filling a
+ * slot, during this time the ISR will not add stream packets of
+ * its own to the ring.
+ */
+ALIGN4 static uint8_t tx_packet_buf[TX_PACKET_SLOTS * ENDPOINT_BUF_SIZE];
+FIFO_ASSERT_CAPACITY(tx_packet_buf);
+static fifo_t tx_packets;
+static volatile uint8_t tx_packets_in_flight = 0;
+static volatile bool tx_packet_reserved = false;
 
-static endpoint_state_t endpoint_state[USB_NUM_ENDPOINTS] = {};
+/*
+ * The record FIFO holds length prefixed application messages,
+ * see usb_tx_write_record(). tx_record_remaining is the number
+ * of bytes of a record that was too large for a single packet
+ * and still need to be sent at the start of the next packet.
+ */
+static uint8_t tx_record_buf[256] = {};
+FIFO_ASSERT_CAPACITY(tx_record_buf);
+static fifo_t tx_records;
+static uint8_t tx_record_remaining = 0;
+
+/*
+ * TX coalescing policy for the stream data of all channels, see
+ * usb_tx_set_policy(). tx_wait_frames counts the SOF frames
+ * during which stream data has been waiting in each channel.
+ */
+static volatile uint8_t tx_policy_min_bytes = 1;
+static volatile uint8_t tx_policy_max_frames = 0;
+static volatile uint8_t tx_wait_frames[USB_CHANNELS] = {};
+
+/*
+ * Weighted round robin over the channels, see
+ * usb_tx_set_channel_weight(). tx_channel is the channel that
+ * is currently being served and tx_channel_credit the number of
+ * packets it may still send before it is the next one's turn.
+ */
+static volatile uint8_t tx_channel_weight[USB_CHANNELS] = {[0 ... USB_CHANNELS - 1] = 1};
+static uint8_t tx_channel = 0;
+static uint8_t tx_channel_credit = 0;
+
+/*
+ * Hosts without the Windows HID driver bug (Linux hidraw, libusb)
+ * can ask for stream packets of exactly the queued length with
+ * DRV_CMD_SET_SHORT_PACKETS, the default after every bus reset is
+ * the Windows compatible padding to full sized packets.
+ */
+static volatile bool tx_short_packets = false;
+
+/*
+ * With USB_STREAM_COMPRESS the host can ask for compressed stream
+ * packets with DRV_CMD_SET_COMPRESSION, see stream_compress().
+ */
+#ifdef USB_STREAM_COMPRESS
+static volatile bool tx_compress = false;
+#endif
+
+/*
+ * Bit masks of the RX buffer descriptors of the stream endpoints
+ * (bit 2 * lane + odd). Pending ones contain a packet that has
+ * arrived ahead of its predecessor on another lane, held ones have
+ * been processed but are held back by the CPU because usb_rx
+ * does not have enough space for another full payload.
+ */
+static volatile uint8_t stream_rx_pending = 0;
+static volatile uint8_t stream_rx_held = 0;
+
+/*
+ * Credit based flow control for the OUT stream, see
+ * DRV_CMD_CREDIT. rx_stream_packets counts the stream packets
+ * that have been processed, rx_credit is the credit limit that
+ * has last been advertised to the host.
+ */
+static bool rx_credit_enabled = false;
+static uint8_t rx_stream_packets = 0;
+static uint8_t rx_credit = 0;
+
+/*
+ * With more than one lane every packet in each direction carries
+ * a sequence number, tx_packets_done marks the TX ring slots whose
+ * transmission has completed but which could not be released yet.
+ */
+static volatile uint16_t tx_packets_done = 0;
+#ifdef USB_PACKET_SEQUENCE
+static uint8_t tx_sequence = 0;
+static uint8_t rx_sequence = 0;
+#endif
+
+/*
+ * With USB_STREAM_CHECK the received packets are verified, packets
+ * with a wrong CRC are dropped and counted in rx_crc_errors. With
+ * only one lane the gaps in the sequence numbers are counted in
+ * rx_lost (with more lanes a lost packet would stall the reordering).
+ */
+#ifdef USB_STREAM_CHECK
+static uint32_t rx_lost = 0;
+static uint32_t rx_crc_errors = 0;
+#endif
 
-static usb_endpoint_buffer_t endpoint_0_rx_buf;
-static usb_endpoint_buffer_t endpoint_1_rx_buf;
-static usb_endpoint_buffer_t endpoint_1_tx_buf;
+/*
+ * In bulk mode the buffer descriptors point directly into usb_tx,
+ * tx_stream_in_flight is the number of bytes at its read end that
+ * are currently owned by the USB. A transfer that ends with a full
+ * sized packet must be terminated with a zero length packet.
+ */
+#if USB_TRANSPORT_BULK
+static volatile uint16_t tx_stream_in_flight = 0;
+static bool tx_need_zlp = false;
+#endif
 
-static volatile message_packet_state_t message_packet_state = MSG_FREE;
-static volatile uint8_t message_packet_buffer[64];
+#ifdef USB_ISO_ENDPOINT
+/*
+ * The isochronous stream is a ring of USB_ISO_FRAME_SLOTS frames
+ * of USB_ISO_PACKET_SIZE bytes, the buffer descriptors point
+ * directly into it. A packet never crosses a frame boundary, so
+ * after an underrun the ring will be frame aligned again as soon
+ * as the current frame has been completed. iso_in_flight is the
+ * number of bytes at the read end currently owned by the USB.
+ */
+static uint8_t iso_fifo_buf[USB_ISO_FRAME_SLOTS * USB_ISO_PACKET_SIZE];
+FIFO_ASSERT_CAPACITY(iso_fifo_buf);
+fifo_t usb_iso;
+static volatile uint16_t iso_in_flight = 0;
+static volatile uint8_t iso_alt_setting = 0;
+#endif
+
+#if USB_TRANSPORT_CDC
+/*
+ * Line coding of the CDC-ACM serial port (115200 8N1), it has no
+ * effect on the stream but the host expects to read it back.
+ */
+static uint8_t cdc_line_coding[CDC_LINE_CODING_SIZE] = {0x00, 0xc2, 0x01, 0x00, 0, 0, 8};
+#endif
 
-static uint8_t tx_fifo_buf[512] = {};
-static uint8_t rx_fifo_buf[512] = {};
+#ifdef USB_STREAM_TIMESTAMP
+/*
+ * SysTick value at the last SOF for the sub-frame part of the
+ * timestamps. SysTick is set up by the application and is not
+ * synchronized to the frames, only the ticks since the SOF are
+ * used, so its period must be at least one frame (1 ms).
+ */
+static volatile uint32_t sof_systick = 0;
 
-fifo_t usb_rx;
-fifo_t usb_tx;
+/**
+ * The current time as the frame number (11 bits) and the time
+ * since the SOF in 1/32 frame (5 bits) above it.
+ */
+static uint16_t frame_time(void) {
+    uint32_t period = SysTick->LOAD + 1;
+    uint32_t now = SysTick->VAL;
+    uint32_t ticks = sof_systick >= now ? sof_systick - now : sof_systick + period - now;
+    uint32_t fraction = ticks * 32 / period;
+    if (fraction > 31) {
+        fraction = 31;
+    }
+    return (USB0->FRMNUML | (USB0->FRMNUMH & 0x7) << 8) | fraction << 11;
+}
+
+/**
+ * Remember the frame in which the packet (the oldest data in
+ * it) has been queued, the timestamp is only preliminary.
+ */
+static void packet_queued(hid_packet_header_t* p, uint8_t frames_ago) {
+    uint16_t frame = frame_time() - frames_ago;
+    p->timestamp[0] = frame;
+    p->timestamp[1] = frame >> 8 & 0x7;
+}
+
+/**
+ * Replace the preliminary timestamp with the time the packet is
+ * handed to the USB and the number of frames it has been queued.
+ */
+static void packet_sent(hid_packet_header_t* p) {
+    uint16_t queued = p->timestamp[0] | (p->timestamp[1] & 0x7) << 8;
+    uint16_t now = frame_time();
+    uint16_t age = (now - queued) & 0x7ff;
+    p->timestamp[0] = now;
+    p->timestamp[1] = now >> 8;
+    p->age = age < 0xff ? age : 0xff;
+}
+#else
+#define packet_queued(p, frames_ago) ((void)(p))
+#define packet_sent(p) ((void)(p))
+#endif
 
 /**
  * Buffer descriptor table, aligned to a 512-byte boundary
@@ -151,7 +404,46 @@ ALIGN512 static buffer_descriptor_t buf_desc_table[USB_NUM_ENDPOINTS * 4];
  */
 WEAK void usb_hook_led_rx(bool on) {}
 WEAK void usb_hook_led_tx(bool on) {}
-WEAK void usb_hook_message_packet(volatile uint8_t* data) {}
+
+/**
+ * Class and vendor requests that are not handled by the driver
+ * itself are passed to the application, it must answer them with
+ * usb_control_send() or usb_control_receive() (or neither if there
+ * is no data stage) and return true, false will stall the request.
+ */
+WEAK bool usb_hook_control_request(const setup_t* setup) {
+    return false;
+}
+
+static bool queue_message_packet(uint8_t magic, const uint8_t* data, uint8_t size) {
+    uint8_t* slot;
+    bool ok = false;
+#ifndef USB_MESSAGE_ENDPOINT
+    // the bulk pipe has no framing, there is nothing but the stream
+    return false;
+#endif
+    if (size > USB_PACKET_PAYLOAD_SIZE) {
+        size = USB_PACKET_PAYLOAD_SIZE;
+    }
+
+    /*
+     * messages may be queued from main() and from the ISR
+     * (hooks and driver packets), the ring has only one
+     * producer at a time if interrupts are masked.
+     */
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (fifo_reserve(&tx_messages, &slot) >= ENDPOINT_BUF_SIZE) {
+        hid_packet_header_t* p = (hid_packet_header_t*)slot;
+        p->payload_size = magic;
+        memcpy((uint8_t*)p->payload_data, data, size);
+        packet_queued(p, 0);
+        fifo_commit(&tx_messages, ENDPOINT_BUF_SIZE);
+        ok = true;
+    }
+    __set_PRIMASK(primask);
+    return ok;
+}
 
 /**
  * A "message packet" here is nothing USB specific, instead it
@@ -163,39 +455,366 @@ WEAK void usb_hook_message_packet(volatile uint8_t* data) {}
  * stream data.
  *
  * This function will enqueue such a message by copying the data to
- * its own buffer and return true if successful. It will be sent
- * through the next available IN transaction. If there is already
- * a message queued then nothing happens and the function just
- * returns false, the application must try again later.
+ * the message queue and return true if successful. It will be sent
+ * through the next available IN transaction. If all USB_MESSAGE_SLOTS
+ * slots of the queue are occupied then nothing happens and the
+ * function just returns false, the application must try again later.
  */
 bool usb_send_message_packet(uint8_t* data, uint8_t size) {
-    if (message_packet_state == MSG_FREE){
-        if (size > sizeof(message_packet_buffer) - sizeof(hid_packet_header_t)) {
-            size = sizeof(message_packet_buffer) - sizeof(hid_packet_header_t);
-        }
-        hid_packet_header_t* p = (hid_packet_header_t*)message_packet_buffer;
-        p->payload_size = MAGIC_MESSAGE_PACKET;
-        for (int i=0; i<size; i++) {
-            p->payload_data[i] = data[i];
-        }
-        message_packet_state = MSG_QUEUED;
+    if (queue_message_packet(MAGIC_MESSAGE_PACKET, data, size)) {
+        usb_tx_flush();
         return true;
     }
     return false;
 }
 
-static void init_buffer_descriptor(uint8_t endpoint, usb_endpoint_buffer_t buffer, uint8_t buffer_size) {
+static uint8_t stream_rx_credit(void);
+
+#ifdef FIFO_STATS
+static uint8_t put_stats(uint8_t* dest, fifo_stats_t* stats) {
+    uint32_t values[] = {
+        stats->high_water,
+        stats->passed,
+        stats->dropped,
+        stats->empty_polls
+    };
+    memcpy(dest, values, sizeof(values));
+    return sizeof(values);
+}
+#endif
+
+/**
+ * Driver packets use the same mechanism as the message packets
+ * but with a different magic number, they are not passed to the
+ * application, instead they are commands for the driver itself.
+ * The first payload byte is the command, the answer is sent back
+ * as a driver packet starting with the command and a status byte.
+ *
+ * DRV_CMD_GET_STATS answers with the fifo_stats_t of usb_tx
+ * followed by that of usb_rx, each as 4 little endian uint32.
+ *
+ * DRV_CMD_SET_TX_POLICY takes min_bytes and max_frames as the
+ * next two bytes, see usb_tx_set_policy().
+ *
+ * DRV_CMD_SET_SHORT_PACKETS takes one byte, if it is not 0 then
+ * stream packets are no longer padded to the full packet size.
+ *
+ * DRV_CMD_SET_CHANNEL_WEIGHT takes the channel and its weight as
+ * the next two bytes, see usb_tx_set_channel_weight().
+ *
+ * DRV_CMD_CREDIT takes one byte to enable (not 0) or disable the
+ * credit based flow control, see stream_check_credit(). The answer
+ * and all the following credit updates contain the credit limit.
+ *
+ * DRV_CMD_GET_CHECK_STATS answers with the number of lost packets
+ * and the number of CRC errors, each as little endian uint32.
+ *
+ * DRV_CMD_SET_COMPRESSION takes one byte, if it is not 0 then
+ * stream packets may be sent compressed.
+ */
+static void handle_driver_packet(volatile uint8_t* data) {
+    uint8_t answer[2 + 2 * sizeof(fifo_stats_t)];
+    uint8_t size = 2;
+
+    answer[0] = data[0];
+    answer[1] = DRV_UNSUPPORTED;
+
+    switch (data[0]) {
+
+    case DRV_CMD_GET_STATS:
+#ifdef FIFO_STATS
+        answer[1] = DRV_OK;
+        size += put_stats(&answer[size], &usb_tx.stats);
+        size += put_stats(&answer[size], &usb_rx.stats);
+#endif
+        break;
+
+    case DRV_CMD_SET_TX_POLICY:
+        answer[1] = DRV_OK;
+        usb_tx_set_policy(data[1], data[2]);
+        break;
+
+    case DRV_CMD_SET_SHORT_PACKETS:
+        answer[1] = DRV_OK;
+        tx_short_packets = data[1] != 0;
+        break;
+
+    case DRV_CMD_SET_CHANNEL_WEIGHT:
+        if (usb_tx_set_channel_weight(data[1], data[2])) {
+            answer[1] = DRV_OK;
+        }
+        break;
+
+    case DRV_CMD_CREDIT:
+        answer[1] = DRV_OK;
+        rx_credit_enabled = data[1] != 0;
+        rx_credit = stream_rx_credit();
+        answer[size++] = rx_credit;
+        break;
+
+    case DRV_CMD_GET_CHECK_STATS:
+#ifdef USB_STREAM_CHECK
+        answer[1] = DRV_OK;
+        memcpy(&answer[size], (uint32_t[]){rx_lost, rx_crc_errors}, 2 * sizeof(uint32_t));
+        size += 2 * sizeof(uint32_t);
+#endif
+        break;
+
+    case DRV_CMD_SET_COMPRESSION:
+#ifdef USB_STREAM_COMPRESS
+        answer[1] = DRV_OK;
+        tx_compress = data[1] != 0;
+#endif
+        break;
+    }
+
+    queue_message_packet(MAGIC_DRIVER_PACKET, answer, size);
+}
+
+static void stream_check_tx();
+
+#if !USB_TRANSPORT_BULK
+/**
+ * The number of valid payload bytes: the payload size of stream
+ * packets (also compressed ones) and the complete payload of all
+ * the other kinds of packets.
+ */
+static uint8_t packet_payload_length(uint8_t payload_size) {
+    if (COMPRESSED_PACKET(payload_size)) {
+        return payload_size & ~COMPRESSED_PACKET_FLAG;
+    }
+    return payload_size < USB_PACKET_PAYLOAD_SIZE ? payload_size : USB_PACKET_PAYLOAD_SIZE;
+}
+#endif
+
+#ifdef USB_STREAM_CHECK
+/**
+ * CRC-8 over the header (without the CRC itself) and the
+ * valid bytes of the payload.
+ */
+static uint8_t packet_crc(hid_packet_header_t* p) {
+    uint8_t crc = crc8(0, (volatile uint8_t*)p, offsetof(hid_packet_header_t, crc));
+    return crc8(crc, p->payload_data, packet_payload_length(p->payload_size));
+}
+#endif
+
+/**
+ * Fetch the next message packet that has been received from
+ * the host, this is meant to be called from main context.
+ * @param data buffer for USB_MESSAGE_SIZE bytes of message
+ * @return true if a message was copied to data
+ */
+bool usb_poll_message(uint8_t* data) {
+    uint8_t* slot;
+    if (fifo_peek(&rx_messages, 0, &slot) < ENDPOINT_BUF_SIZE) {
+        return false;
+    }
+    memcpy(data, slot + sizeof(hid_packet_header_t), USB_MESSAGE_SIZE);
+    fifo_release(&rx_messages, ENDPOINT_BUF_SIZE);
+    return true;
+}
+
+/**
+ * Set the TX coalescing policy for the stream data in usb_tx.
+ * A stream packet is sent as soon as at least min_bytes are
+ * queued or, if max_frames is not 0, when the oldest queued data
+ * has been waiting for max_frames SOF frames, whichever happens
+ * first. A full packet is always sent immediately. The default
+ * (1, 0) sends immediately for lowest latency, larger values
+ * trade latency for fewer and fuller packets:
+ *
+ *   (1, 0)   send immediately
+ *   (N, 0)   send when at least N bytes are queued
+ *   (63, K)  send full packets or after a deadline of K frames
+ *   (N, K)   send when N bytes are queued or after K frames
+ *
+ * The host can also change it with DRV_CMD_SET_TX_POLICY.
+ */
+void usb_tx_set_policy(uint8_t min_bytes, uint8_t max_frames) {
+    if (min_bytes == 0) {
+        min_bytes = 1;
+    }
+    tx_policy_min_bytes = min_bytes;
+    tx_policy_max_frames = max_frames;
+    usb_tx_flush();
+}
+
+/**
+ * Set the weight of a channel for the TX scheduler, when all
+ * channels have data queued then each one may send as many
+ * packets in a row as its weight before it is the next one's turn.
+ * The default weight of every channel is 1.
+ * @param weight 1..255
+ * @return false if the channel does not exist
+ */
+bool usb_tx_set_channel_weight(uint8_t channel, uint8_t weight) {
+    if (channel >= USB_CHANNELS) {
+        return false;
+    }
+    tx_channel_weight[channel] = weight ? weight : 1;
+    return true;
+}
+
+/**
+ * Arm the next IN transaction of the stream endpoints immediately if there
+ * is something to send and a TX buffer descriptor is free, without
+ * waiting for the next SOF interrupt to poll the TX queues. This
+ * is done with all interrupts masked so it can not race with the
+ * USB interrupt. All the usb_tx_* functions below call this
+ * automatically, it is only needed after writing to usb_tx directly.
+ */
+void usb_tx_flush(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stream_check_tx();
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Write stream data into usb_tx. The FIFO itself is only safe for
+ * one producer but usb_tx may be written from main() and from the
+ * hooks (which run in the USB interrupt) at the same time, therefore
+ * the write is done with all interrupts masked. The bytes of one call
+ * will always be contiguous in the stream, no matter how many
+ * contexts are writing.
+ * @return number of bytes actually written
+ */
+unsigned usb_tx_write(const uint8_t* data, unsigned count) {
+    return usb_tx_write_channel(0, data, count);
+}
+
+/**
+ * Same as usb_tx_write() but for any of the USB_CHANNELS channels.
+ * @return number of bytes actually written
+ */
+unsigned usb_tx_write_channel(uint8_t channel, const uint8_t* data, unsigned count) {
+    if (channel >= USB_CHANNELS) {
+        return 0;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    count = fifo_write(&usb_tx_channel[channel], data, count);
+    stream_check_tx();
+    __set_PRIMASK(primask);
+    return count;
+}
+
+/**
+ * Queue one record of 1..255 bytes for transmission. Records are
+ * sent in separate record packets (outside of the byte stream)
+ * and are never split by the driver unless a record is larger
+ * than a packet. Each record packet contains a sequence of
+ * records, each with a length byte followed by the data, a
+ * length byte of zero or the end of the packet terminates it.
+ * If the previous record packet ended with an incomplete record
+ * then the next one will begin with the remaining bytes of it.
+ *
+ * The record is either queued completely or not at all, this is
+ * safe to be used from main() and from the hooks at the same time.
+ * Records are not available on the bulk transport.
+ * @return true if the record was queued
+ */
+bool usb_tx_write_record(const uint8_t* data, uint8_t size) {
+#if USB_TRANSPORT_BULK
+    return false;
+#endif
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool ok = fifo_write_record(&tx_records, data, size);
+    stream_check_tx();
+    __set_PRIMASK(primask);
+    return ok;
+}
+
+/**
+ * Zero-copy transmission of stream data: reserve the next free
+ * slot in the TX ring, the application can then fill in the
+ * payload_size (and the channel if there is more than one) and
+ * up to USB_PACKET_PAYLOAD_SIZE bytes of payload directly and
+ * must then call usb_tx_packet_commit() to queue it.
+ * Packets committed this way are sent in order with the stream
+ * packets assembled from usb_tx. This is safe to be used from
+ * main() and from the hooks. On the bulk transport only the
+ * payload is sent, as one packet of payload_size bytes.
+ * @return pointer to the slot or NULL if the ring is full
+ */
+hid_packet_header_t* usb_tx_packet_reserve(void) {
+    uint8_t* p;
+
+    /*
+     * A hook running in the ISR might try to reserve a slot while
+     * main() is in the middle of filling one, this must fail. The
+     * other way around is no problem because the interrupt will
+     * always have committed its slot before main() continues.
+     */
+    if (tx_packet_reserved) {
+        return NULL;
+    }
+    tx_packet_reserved = true;
+    if (fifo_reserve(&tx_packets, &p) < ENDPOINT_BUF_SIZE) {
+        tx_packet_reserved = false;
+        return NULL;
+    }
+    return (hid_packet_header_t*)p;
+}
+
+/**
+ * Queue the slot that was filled after usb_tx_packet_reserve().
+ */
+void usb_tx_packet_commit(void) {
+#ifdef USB_STREAM_TIMESTAMP
+    uint8_t* p;
+    fifo_reserve(&tx_packets, &p);
+    packet_queued((hid_packet_header_t*)p, 0);
+#endif
+    fifo_commit(&tx_packets, ENDPOINT_BUF_SIZE);
+    tx_packet_reserved = false;
+    usb_tx_flush();
+}
+
+#ifdef USB_ISO_ENDPOINT
+/**
+ * Write constant rate data into usb_iso, one frame of
+ * USB_ISO_PACKET_SIZE bytes will be sent in every USB frame.
+ * This is safe to be used from main() and from the hooks.
+ * @return number of bytes actually written
+ */
+unsigned usb_iso_write(const uint8_t* data, unsigned count) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    count = fifo_write(&usb_iso, data, count);
+    __set_PRIMASK(primask);
+    return count;
+}
+#endif
+
+/**
+ * Initialize the buffer descriptors and the endpoint control
+ * register of one endpoint from its entry in endpoint_table.
+ * The double buffered RX buffers (even and odd) come from the
+ * endpoint table, the TX buffers will be assigned on the fly.
+ */
+static void init_buffer_descriptor(uint8_t endpoint) {
+    const endpoint_table_t* ep = &endpoint_table[endpoint];
+    uint8_t endpt = 0;
     endpoint_state[endpoint].tx_odd = EVEN;
     endpoint_state[endpoint].tx_data1 = DATA0;
-    buf_desc_table[BDT_INDEX(endpoint, RX, EVEN)].desc = BD_OWNED_BY_USB(buffer_size, DATA0);
-    buf_desc_table[BDT_INDEX(endpoint, RX, EVEN)].addr = buffer[EVEN];
-    buf_desc_table[BDT_INDEX(endpoint, RX, ODD)].desc = BD_OWNED_BY_USB(buffer_size, DATA1);
-    buf_desc_table[BDT_INDEX(endpoint, RX, ODD)].addr = buffer[ODD];
+    if (ep->direction & ENDPOINT_OUT) {
+        buf_desc_table[BDT_INDEX(endpoint, RX, EVEN)].desc = BD_OWNED_BY_USB(ep->size, DATA0);
+        buf_desc_table[BDT_INDEX(endpoint, RX, EVEN)].addr = ep->rx_buf;
+        buf_desc_table[BDT_INDEX(endpoint, RX, ODD)].desc = BD_OWNED_BY_USB(ep->size, DATA1);
+        buf_desc_table[BDT_INDEX(endpoint, RX, ODD)].addr = ep->rx_buf + ep->size;
+        endpt |= USB_ENDPT_EPRXEN_MASK;
+    }
+    if (ep->direction & ENDPOINT_IN) {
+        endpt |= USB_ENDPT_EPTXEN_MASK;
+    }
+    if (ep->type != ENDPOINT_TYPE_ISOCHRONOUS) {
+        endpt |= USB_ENDPT_EPHSHK_MASK;
+    }
     buf_desc_table[BDT_INDEX(endpoint, TX, EVEN)].desc = 0;
     buf_desc_table[BDT_INDEX(endpoint, TX, ODD)].desc = 0;
-    USB0->ENDPOINT[endpoint].ENDPT = USB_ENDPT_EPRXEN_MASK
-                                   | USB_ENDPT_EPTXEN_MASK
-                                   | USB_ENDPT_EPHSHK_MASK;
+    USB0->ENDPOINT[endpoint].ENDPT = endpt;
 }
 
 void usb_device_init(void) {
@@ -240,8 +859,17 @@ void usb_device_init(void) {
     USB0->CONTROL = USB_CONTROL_DPPULLUPNONOTG_MASK;
 
     // initialize FIFO buffers for the stream-over-hid protocol.
-    fifo_init(&usb_rx, rx_fifo_buf, sizeof(rx_fifo_buf));
-    fifo_init(&usb_tx, tx_fifo_buf, sizeof(tx_fifo_buf));
+    for (i = 0; i < USB_CHANNELS; i++) {
+        fifo_init(&usb_rx_channel[i], rx_fifo_buf[i], sizeof(rx_fifo_buf[i]));
+        fifo_init(&usb_tx_channel[i], tx_fifo_buf[i], sizeof(tx_fifo_buf[i]));
+    }
+    fifo_init(&tx_packets, tx_packet_buf, sizeof(tx_packet_buf));
+    fifo_init(&tx_records, tx_record_buf, sizeof(tx_record_buf));
+    fifo_init(&tx_messages, tx_message_buf, sizeof(tx_message_buf));
+    fifo_init(&rx_messages, rx_message_buf, sizeof(rx_message_buf));
+#ifdef USB_ISO_ENDPOINT
+    fifo_init(&usb_iso, iso_fifo_buf, sizeof(iso_fifo_buf));
+#endif
 }
 
 void endpoint_prepare_next_tx(uint8_t endpoint, volatile void* data, uint8_t length) {
@@ -266,7 +894,8 @@ void bd_rx_release(buffer_descriptor_t* buf_desc) {
      * they were first initialized during USB reset.
      */
     uint8_t data1 = buf_desc->desc & BD_DATA1_MASK ? 1 : 0;
-    buf_desc->desc = BD_OWNED_BY_USB(ENDPOINT_BUF_SIZE, data1);
+    uint16_t size = endpoint_table[(buf_desc - buf_desc_table) >> 2].size;
+    buf_desc->desc = BD_OWNED_BY_USB(size, data1);
 }
 
 static bool endpoint_have_free_tx_descriptor(uint8_t endpoint) {
@@ -280,109 +909,886 @@ static bool endpoint_have_free_tx_descriptor(uint8_t endpoint) {
     return (desc & BD_OWN_MASK) == 0;
 }
 
-static void endpoint_1_check_tx() {
-    uint8_t tx_byte;
-    if (endpoint_have_free_tx_descriptor(1)) {
+#if !USB_TRANSPORT_BULK
+/**
+ * Fill the payload of a record packet with as many complete
+ * records as will fit, a record is only split if it would not
+ * fit into an empty packet anyways.
+ */
+static void stream_pack_records(uint8_t* dest) {
+    unsigned n = 0;
+    unsigned size;
+
+    if (tx_record_remaining) {
+        n = fifo_read(&tx_records, dest, tx_record_remaining < USB_PACKET_PAYLOAD_SIZE
+                                         ? tx_record_remaining : USB_PACKET_PAYLOAD_SIZE);
+        tx_record_remaining -= n;
+    }
+
+    while (n < USB_PACKET_PAYLOAD_SIZE && (size = fifo_get_record_size(&tx_records))) {
+        if (n + 1 + size <= USB_PACKET_PAYLOAD_SIZE) {
+            n += fifo_read(&tx_records, dest + n, 1 + size);
+        } else if (n == 0) {
+            n = fifo_read(&tx_records, dest, USB_PACKET_PAYLOAD_SIZE);
+            tx_record_remaining = 1 + size - n;
+        } else {
+            break;
+        }
+    }
+
+    if (n < USB_PACKET_PAYLOAD_SIZE) {
+        dest[n] = 0;
+    }
+}
+
+/**
+ * Apply the TX coalescing policy to one channel.
+ */
+static bool stream_due(uint8_t channel) {
+    unsigned size = fifo_get_size(&usb_tx_channel[channel]);
+    return size >= tx_policy_min_bytes
+        || size >= USB_PACKET_PAYLOAD_SIZE
+        || (tx_policy_max_frames && tx_wait_frames[channel] >= tx_policy_max_frames);
+}
+
+/**
+ * The weighted round robin scheduler: the current channel stays
+ * selected while it has credit left and data that is due, then
+ * the next channel with data that is due gets its full credit.
+ * If all channels are empty then the current one is returned
+ * anyway so that the underrun will be counted.
+ * @return the channel to send from or -1 if none is due yet
+ */
+static int stream_next_channel(void) {
+    bool empty = true;
+    for (uint8_t i = 0; i <= USB_CHANNELS; i++) {
+        if (tx_channel_credit && fifo_get_size(&usb_tx_channel[tx_channel])) {
+            empty = false;
+            if (stream_due(tx_channel)) {
+                tx_channel_credit--;
+                return tx_channel;
+            }
+        }
+        tx_channel = tx_channel + 1 < USB_CHANNELS ? tx_channel + 1 : 0;
+        tx_channel_credit = tx_channel_weight[tx_channel];
+    }
+    return empty ? tx_channel : -1;
+}
+
+/**
+ * Try to fill the payload with RLE compressed stream data, see
+ * rle.c. This is only attempted when there is more data queued
+ * than would fit uncompressed and the result is only used when
+ * it actually carries more than that, so incompressible data
+ * costs some CPU time but never any bandwidth.
+ * @return true if a compressed packet has been prepared
+ */
+static bool stream_compress(fifo_t* fifo, hid_packet_header_t* p) {
+#ifdef USB_STREAM_COMPRESS
+    unsigned consumed;
+    if (tx_compress && fifo_get_size(fifo) > USB_PACKET_PAYLOAD_SIZE) {
+        uint8_t size = rle_encode(fifo, p->payload_data, USB_PACKET_PAYLOAD_SIZE, &consumed);
+        if (consumed > USB_PACKET_PAYLOAD_SIZE) {
+            fifo_release(fifo, consumed);
+            p->payload_size = COMPRESSED_PACKET_FLAG | size;
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+/**
+ * Pack the records or the stream data from the channels into the
+ * next free slot of the TX ring. This only happens when no packet
+ * is waiting for a descriptor so that the slot contains as much
+ * data as possible. Records have priority over the stream.
+ */
+static void stream_pack() {
+    uint8_t* slot;
+    int channel;
+    if (!tx_packet_reserved
+    &&  fifo_get_size(&tx_packets) == tx_packets_in_flight * ENDPOINT_BUF_SIZE
+    &&  fifo_reserve(&tx_packets, &slot) >= ENDPOINT_BUF_SIZE) {
+        hid_packet_header_t* p = (hid_packet_header_t*)slot;
+        if (fifo_get_size(&tx_records)) {
+            p->payload_size = MAGIC_RECORD_PACKET;
+            stream_pack_records((uint8_t*)p->payload_data);
+            packet_queued(p, 0);
+            fifo_commit(&tx_packets, ENDPOINT_BUF_SIZE);
+        } else if ((channel = stream_next_channel()) >= 0) {
+            /*
+             * an empty channel at this point is an underrun,
+             * fifo_read() will count it as an empty poll.
+             */
+            if (!stream_compress(&usb_tx_channel[channel], p)) {
+                p->payload_size = fifo_read(&usb_tx_channel[channel], (uint8_t*)p->payload_data,
+                                            USB_PACKET_PAYLOAD_SIZE);
+            }
+#if USB_CHANNELS > 1
+            p->channel = channel;
+#endif
+            if (p->payload_size) {
+                packet_queued(p, tx_wait_frames[channel]);
+                fifo_commit(&tx_packets, ENDPOINT_BUF_SIZE);
+                tx_wait_frames[channel] = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Arm every free TX buffer descriptor of the stream endpoints.
+ * The packets from the TX ring are striped across all lanes,
+ * each one is stamped with the next sequence number when it
+ * is handed to the USB so the host can restore the order.
+ */
+static void stream_check_tx() {
+    uint8_t* slot;
+    for (uint8_t lane = 0; lane < USB_STREAM_LANES; lane++) {
+        uint8_t endpoint = STREAM_ENDPOINT(lane);
+        if (!endpoint_have_free_tx_descriptor(endpoint)) {
+            continue;
+        }
 
         /*
          * Our special message packets have priority
-         * over stream data.
+         * over stream data, they always use the first lane.
          */
-        if (message_packet_state == MSG_QUEUED) {
-            endpoint_prepare_next_tx(1, message_packet_buffer, 64);
-            message_packet_state = MSG_TRANSMITTING;
+        if (lane == 0 && fifo_peek(&tx_messages, tx_messages_in_flight * ENDPOINT_BUF_SIZE, &slot)) {
+            packet_sent((hid_packet_header_t*)slot);
+#ifdef USB_STREAM_CHECK
+            ((hid_packet_header_t*)slot)->crc = packet_crc((hid_packet_header_t*)slot);
+#endif
+            endpoint_prepare_next_tx(endpoint, slot, 64);
+            tx_messages_in_flight++;
 
         /*
-         * Check if data is in the TX queue and if so
-         * then fill the next TX buffer for sending.
+         * Check if data is in the TX queue and if so then let
+         * the next TX descriptor point directly to the ring slot
+         * containing the next packet.
          */
         } else {
-            if (fifo_get_size(&usb_tx)) {
+            stream_pack();
+            if (fifo_peek(&tx_packets, tx_packets_in_flight * ENDPOINT_BUF_SIZE, &slot)) {
                 usb_hook_led_tx(true);
-                uint8_t odd = endpoint_state[1].tx_odd;
-                hid_packet_header_t* p = (hid_packet_header_t*)endpoint_1_tx_buf[odd];
-                uint8_t i = 0;
-                while ((i < 64 - sizeof(hid_packet_header_t)) && fifo_pop(&usb_tx, &tx_byte)) {
-                    p->payload_data[i++] = tx_byte;
-                }
-                p->payload_size = i;
+#ifdef USB_PACKET_SEQUENCE
+                ((hid_packet_header_t*)slot)->sequence = tx_sequence++;
+#endif
+                packet_sent((hid_packet_header_t*)slot);
+#ifdef USB_STREAM_CHECK
+                ((hid_packet_header_t*)slot)->crc = packet_crc((hid_packet_header_t*)slot);
+#endif
 
                 /*
                  * Due to a bug in the generic Windows HID driver we must always
                  * either TX a full sized packet or no packet at all, otherwise
                  * the driver would be confused. This is also the reason we need
-                 * to waste one byte for the payload size in our reports.
+                 * to waste one byte for the payload size in our reports. Other
+                 * hosts may have asked for stream packets without the padding,
+                 * the other kinds of packets are always sent full sized.
                  */
-                endpoint_prepare_next_tx(1, p, 64);
+                uint8_t size = ((hid_packet_header_t*)slot)->payload_size;
+                if (tx_short_packets && (size <= USB_PACKET_PAYLOAD_SIZE || COMPRESSED_PACKET(size))) {
+                    size = packet_payload_length(size) + sizeof(hid_packet_header_t);
+                } else {
+                    size = ENDPOINT_BUF_SIZE;
+                }
+                endpoint_prepare_next_tx(endpoint, slot, size);
+                tx_packets_in_flight++;
+            }
+        }
+    }
+}
+
+#else
+/**
+ * Arm both TX buffer descriptors of the bulk endpoint back to back
+ * so the next IN transaction can follow immediately after the
+ * current one. Packets committed to the TX ring are sent as they
+ * are (just their payload), the stream data is sent in place from
+ * usb_tx in packets of up to 64 bytes. There is no TX policy here,
+ * bulk transactions do not waste any bandwidth on the bus when
+ * they are short.
+ */
+static void stream_check_tx() {
+    uint8_t* data;
+    unsigned size;
+#ifdef USB_MESSAGE_ENDPOINT
+    /*
+     * the message packets have their own HID endpoint here
+     */
+    if (endpoint_have_free_tx_descriptor(USB_MESSAGE_ENDPOINT)
+    &&  fifo_peek(&tx_messages, tx_messages_in_flight * ENDPOINT_BUF_SIZE, &data)) {
+        endpoint_prepare_next_tx(USB_MESSAGE_ENDPOINT, data, 64);
+        tx_messages_in_flight++;
+    }
+#endif
+    while (endpoint_have_free_tx_descriptor(STREAM_ENDPOINT(0))) {
+        if (fifo_peek(&tx_packets, tx_packets_in_flight * ENDPOINT_BUF_SIZE, &data)) {
+            hid_packet_header_t* p = (hid_packet_header_t*)data;
+            data = (uint8_t*)p->payload_data;
+            size = p->payload_size;
+            tx_packets_in_flight++;
+        } else if ((size = fifo_peek(&usb_tx, tx_stream_in_flight, &data))) {
+            if (size > ENDPOINT_BUF_SIZE) {
+                size = ENDPOINT_BUF_SIZE;
+            }
+            tx_stream_in_flight += size;
+        } else if (tx_need_zlp) {
+            data = tx_fifo_buf[0];
+            size = 0;
+        } else {
+            break;
+        }
+        usb_hook_led_tx(true);
+        tx_need_zlp = size == ENDPOINT_BUF_SIZE;
+        endpoint_prepare_next_tx(STREAM_ENDPOINT(0), data, size);
+    }
+}
+#endif
+
+/**
+ * A TX ring slot has been sent. With more than one lane the
+ * transmissions may complete out of order, a slot can only be
+ * released after all the slots before it have been released.
+ */
+static void stream_tx_done(uint8_t* slot) {
+    uint8_t* head;
+    tx_packets_done |= 1 << ((slot - tx_packet_buf) / ENDPOINT_BUF_SIZE);
+    while (tx_packets_in_flight && fifo_peek(&tx_packets, 0, &head)) {
+        uint32_t mask = 1 << ((head - tx_packet_buf) / ENDPOINT_BUF_SIZE);
+        if (!(tx_packets_done & mask)) {
+            break;
+        }
+        tx_packets_done &= ~mask;
+        fifo_release(&tx_packets, ENDPOINT_BUF_SIZE);
+        tx_packets_in_flight--;
+    }
+}
+
+static buffer_descriptor_t* stream_rx_bd(uint8_t bit) {
+    return &buf_desc_table[BDT_INDEX(STREAM_ENDPOINT(bit >> 1), RX, bit & 1)];
+}
+
+/**
+ * Flow control for the OUT direction: an RX buffer descriptor is
+ * only given back to the USB if usb_rx would then still be able
+ * to take the full payload of every RX descriptor owned by the USB
+ * or still waiting to be processed. Otherwise it stays owned by
+ * the CPU and the hardware will NAK the host until space has
+ * become available again. With more than one channel the next
+ * packets might be for any channel, so every channel must have
+ * enough space.
+ */
+static bool stream_rx_has_space(void) {
+    unsigned needed = STREAM_RX_PAYLOAD_SIZE;
+    for (uint8_t bit = 0; bit < 2 * USB_STREAM_LANES; bit++) {
+        if ((stream_rx_bd(bit)->desc & BD_OWN_MASK) || (stream_rx_pending & (1 << bit))) {
+            needed += STREAM_RX_PAYLOAD_SIZE;
+        }
+    }
+    for (uint8_t channel = 0; channel < USB_CHANNELS; channel++) {
+        if (fifo_get_free(&usb_rx_channel[channel]) < needed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The credit limit: the number of stream packets the host may have
+ * sent in total (modulo 256) without overrunning any RX FIFO. The
+ * packets the host has already sent but that have not yet been
+ * processed are accounted for because they are not yet counted
+ * in rx_stream_packets but will take their space.
+ */
+static uint8_t stream_rx_credit(void) {
+    unsigned free = fifo_get_free(&usb_rx_channel[0]);
+    for (uint8_t channel = 1; channel < USB_CHANNELS; channel++) {
+        if (fifo_get_free(&usb_rx_channel[channel]) < free) {
+            free = fifo_get_free(&usb_rx_channel[channel]);
+        }
+    }
+    free /= STREAM_RX_PAYLOAD_SIZE;
+    return rx_stream_packets + (free < 127 ? free : 127);
+}
+
+/**
+ * Called at every SOF, when the credit based flow control has been
+ * enabled by the host then every increase of the credit limit is
+ * advertised with a driver packet. The host counts the stream packets
+ * it sends and only sends as long as its count is below the limit,
+ * so it can keep the pipe full without ever being throttled by NAK.
+ * The limit is never lowered, a host that sends exactly up to it
+ * can at worst be NAKed for a moment due to rounding.
+ */
+static void stream_check_credit(void) {
+    uint8_t credit = stream_rx_credit();
+    if (rx_credit_enabled && (int8_t)(credit - rx_credit) > 0) {
+        uint8_t answer[] = {DRV_CMD_CREDIT, DRV_OK, credit};
+        if (queue_message_packet(MAGIC_DRIVER_PACKET, answer, sizeof(answer))) {
+            rx_credit = credit;
+        }
+    }
+}
+
+/**
+ * Give held back RX buffer descriptors to the USB again
+ * as soon as usb_rx has enough space for their payload.
+ */
+static void stream_check_rx(void) {
+    for (uint8_t bit = 0; bit < 2 * USB_STREAM_LANES; bit++) {
+        if ((stream_rx_held & (1 << bit)) && stream_rx_has_space()) {
+            stream_rx_held &= ~(1 << bit);
+            bd_rx_release(stream_rx_bd(bit));
+        }
+    }
+}
+
+/**
+ * Read stream data from usb_rx. This should be used instead of
+ * reading usb_rx directly because it will immediately resume the
+ * reception when the host has been throttled, otherwise this
+ * would only happen during the next SOF interrupt.
+ * @return number of bytes actually read
+ */
+unsigned usb_rx_read(uint8_t* data, unsigned count) {
+    return usb_rx_read_channel(0, data, count);
+}
+
+/**
+ * Same as usb_rx_read() but for any of the USB_CHANNELS channels.
+ * @return number of bytes actually read
+ */
+unsigned usb_rx_read_channel(uint8_t channel, uint8_t* data, unsigned count) {
+    if (channel >= USB_CHANNELS) {
+        return 0;
+    }
+    count = fifo_read(&usb_rx_channel[channel], data, count);
+    if (stream_rx_held) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        stream_check_rx();
+        __set_PRIMASK(primask);
+    }
+    return count;
+}
+
+/**
+ * Process a received packet that does not contain stream data.
+ */
+static void message_rx_packet(hid_packet_header_t* p) {
+    uint8_t* slot;
+
+    if (p->payload_size == MAGIC_MESSAGE_PACKET) {
+        /*
+         * since there is a range of otherwise invalid
+         * sizes above 62 we can use the size field to
+         * encode a special marker here for a special
+         * type of packet that does not contain stream
+         * data. The whole packet is copied into the
+         * message queue, the application can fetch it
+         * with usb_poll_message(). If the queue is full
+         * then the message is lost.
+         */
+        if (fifo_reserve(&rx_messages, &slot) >= ENDPOINT_BUF_SIZE) {
+            memcpy(slot, (uint8_t*)p, ENDPOINT_BUF_SIZE);
+            fifo_commit(&rx_messages, ENDPOINT_BUF_SIZE);
+        }
+
+    } else if (p->payload_size == MAGIC_DRIVER_PACKET) {
+        handle_driver_packet(p->payload_data);
+    }
+}
+
+/**
+ * Process the contents of one received stream packet.
+ */
+static void stream_rx_packet(buffer_descriptor_t* buf_desc) {
+    hid_packet_header_t* p = buf_desc->addr;
+    uint8_t size = buf_desc->desc >> 16;
+
+#if USB_TRANSPORT_BULK
+    // the bulk pipe carries nothing but raw stream data
+    fifo_write(&usb_rx, (uint8_t*)p, size);
+    return;
+#endif
+
+#ifdef USB_STREAM_CHECK
+    if (size < sizeof(hid_packet_header_t) || p->crc != packet_crc(p)) {
+        rx_crc_errors++;
+        return;
+    }
+#if USB_STREAM_LANES == 1
+    rx_lost += (uint8_t)(p->sequence - rx_sequence);
+    rx_sequence = p->sequence + 1;
+#endif
+#endif
+
+    if (size > sizeof(hid_packet_header_t)) {
+        if (p->payload_size <= size - sizeof(hid_packet_header_t)) {
+            /*
+             * all packets with a payload of 0..63 are
+             * interpreted as stream data, the payload data
+             * is extracted and pushed into the RX FIFO of
+             * its channel, unknown channels are dropped.
+             */
+            rx_stream_packets++;
+#if USB_CHANNELS > 1
+            if (p->channel < USB_CHANNELS) {
+                fifo_write(&usb_rx_channel[p->channel], (uint8_t*)p->payload_data, p->payload_size);
             }
+#else
+            fifo_write(&usb_rx, (uint8_t*)p->payload_data, p->payload_size);
+#endif
+        } else {
+            message_rx_packet(p);
         }
     }
 }
 
-static void endpoint_1_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
-    hid_packet_header_t* p;
-    uint8_t size;
+/**
+ * Process the received packets in the order of their sequence
+ * numbers. With more than one lane a packet may arrive before
+ * its predecessor, it then stays pending in its RX buffer (which
+ * also makes its lane NAK) until the predecessor has arrived.
+ * With only one lane every packet is processed immediately.
+ */
+static void stream_process_rx(void) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (uint8_t bit = 0; bit < 2 * USB_STREAM_LANES; bit++) {
+            buffer_descriptor_t* buf_desc = stream_rx_bd(bit);
+            if (!(stream_rx_pending & (1 << bit))) {
+                continue;
+            }
+#if USB_STREAM_LANES > 1
+            if (((hid_packet_header_t*)buf_desc->addr)->sequence != rx_sequence) {
+                continue;
+            }
+            rx_sequence++;
+#endif
+            stream_rx_pending &= ~(1 << bit);
+            stream_rx_packet(buf_desc);
+            if (stream_rx_has_space()) {
+                bd_rx_release(buf_desc);
+            } else {
+                stream_rx_held |= 1 << bit;
+            }
+            progress = true;
+        }
+    }
+}
 
+/**
+ * Handler for the stream endpoints of all lanes.
+ * @return true if the RX buffer descriptor can be released
+ */
+bool stream_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
+#if USB_TRANSPORT_BULK
+    unsigned size;
+#endif
     switch (tok) {
 
     case TOK_IN:
         /*
-         * check whether the last TX was one of our special message
-         * packets and if so mark the message buffer as free again.
+         * check whether the last TX came from the TX ring or from the
+         * message queue, the buffer descriptor still points to the slot
+         * that has been sent, and release the slot in the right ring.
          */
-        if (message_packet_state == MSG_TRANSMITTING) {
-            p = buf_desc->addr;
-            if (p->payload_size == MAGIC_MESSAGE_PACKET) {
-                message_packet_state = MSG_FREE;
-            }
+        if ((uint8_t*)buf_desc->addr >= tx_packet_buf
+        &&  (uint8_t*)buf_desc->addr < tx_packet_buf + sizeof(tx_packet_buf)) {
+            stream_tx_done((uint8_t*)buf_desc->addr);
+        } else if ((uint8_t*)buf_desc->addr >= tx_message_buf
+               &&  (uint8_t*)buf_desc->addr < tx_message_buf + sizeof(tx_message_buf)) {
+            fifo_release(&tx_messages, ENDPOINT_BUF_SIZE);
+            tx_messages_in_flight--;
+        }
+#if USB_TRANSPORT_BULK
+        else if ((uint8_t*)buf_desc->addr >= tx_fifo_buf[0]
+             &&  (uint8_t*)buf_desc->addr < tx_fifo_buf[0] + sizeof(tx_fifo_buf[0])) {
+            size = buf_desc->desc >> BD_BC_SHIFT & 0x3ff;
+            fifo_release(&usb_tx, size);
+            tx_stream_in_flight -= size;
         }
+#endif
 
         /*
          * check whether there is still more data left to transmit
          */
-        endpoint_1_check_tx();
+        stream_check_tx();
         break;
 
     case TOK_OUT:
+        /*
+         * the RX buffer descriptor will be released
+         * by stream_process_rx() or stream_check_rx()
+         */
         usb_hook_led_rx(true);
-        p = buf_desc->addr;
-        size = buf_desc->desc >> 16;
-        if (size > sizeof(hid_packet_header_t)) {
-            if (p->payload_size <= size - sizeof(hid_packet_header_t)) {
-                /*
-                 * all packets with a payload of 0..63 are
-                 * interpreted as stream data, the payload data
-                 * is extracted and pushed into the RX FIFO.
-                 */
-                for (int i = 0; i < p->payload_size; ++i) {
-                    fifo_push(&usb_rx, p->payload_data[i]);
-                }
-
-            } else if (p->payload_size == MAGIC_MESSAGE_PACKET) {
-                /*
-                 * since there is a range of otherwise invalid
-                 * sizes above 62 we can use the size field to
-                 * encode a special marker here for a special
-                 * type of packet that does not contain stream
-                 * data. The application can implement the hook
-                 * below to receive them if it so wishes.
-                 */
-                usb_hook_message_packet(p->payload_data);
+        for (uint8_t bit = 0; bit < 2 * USB_STREAM_LANES; bit++) {
+            if (stream_rx_bd(bit) == buf_desc) {
+                stream_rx_pending |= 1 << bit;
             }
         }
+        stream_process_rx();
+        return false;
+    }
+    return true;
+}
+
+#ifdef USB_ISO_ENDPOINT
+/**
+ * Called at every SOF, arms the TX buffer descriptor of the
+ * isochronous endpoint for the frame after the next one, so there
+ * is always one frame in flight and one waiting. If usb_iso does
+ * not hold a complete frame then whatever there is will be sent
+ * as a short packet (or a zero length packet), the host just sees
+ * less data in that frame.
+ */
+static void iso_check_tx(void) {
+    uint8_t* data = iso_fifo_buf;
+    unsigned size;
+    if (iso_alt_setting && endpoint_have_free_tx_descriptor(USB_ISO_ENDPOINT)) {
+        size = fifo_peek(&usb_iso, iso_in_flight, &data);
+        if (size > USB_ISO_PACKET_SIZE - (data - iso_fifo_buf) % USB_ISO_PACKET_SIZE) {
+            size = USB_ISO_PACKET_SIZE - (data - iso_fifo_buf) % USB_ISO_PACKET_SIZE;
+        }
+        iso_in_flight += size;
+        usb_hook_led_tx(true);
+
+        // isochronous transactions at full speed are always DATA0
+        endpoint_state[USB_ISO_ENDPOINT].tx_data1 = DATA0;
+        endpoint_prepare_next_tx(USB_ISO_ENDPOINT, data, size);
+    }
+}
+
+/**
+ * Handler for the isochronous IN endpoint, there is no handshake,
+ * the data is gone as soon as the transaction has completed.
+ */
+bool iso_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
+    if (tok == TOK_IN) {
+        unsigned size = buf_desc->desc >> BD_BC_SHIFT & 0x3ff;
+        fifo_release(&usb_iso, size);
+        iso_in_flight -= size;
+    }
+    return true;
+}
+#endif
+
+#if USB_TRANSPORT_CDC
+/**
+ * Handler for the HID endpoint of the composite device, it
+ * only carries message packets (and driver packets).
+ * @return true if the RX buffer descriptor can be released
+ */
+bool message_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
+    switch (tok) {
+
+    case TOK_IN:
+        fifo_release(&tx_messages, ENDPOINT_BUF_SIZE);
+        tx_messages_in_flight--;
+        stream_check_tx();
         break;
+
+    case TOK_OUT:
+        usb_hook_led_rx(true);
+        if ((buf_desc->desc >> BD_BC_SHIFT & 0x3ff) > sizeof(hid_packet_header_t)) {
+            message_rx_packet(buf_desc->addr);
+        }
+        break;
+    }
+    return true;
+}
+#endif
+
+#if USB_HID_INTERFACES
+/*
+ * Idle rate from the last HID SET_IDLE request in units of 4 ms,
+ * it is only stored to be read back with GET_IDLE. An IN endpoint
+ * without new data just NAKs, which is what the default 0 (report
+ * only when there is new data) means anyway.
+ */
+static uint8_t hid_idle_rate = 0;
+
+/*
+ * The answer to a GET_REPORT request for the input report, an empty
+ * stream packet. The stream itself is only sent over the interrupt
+ * endpoints, hosts do not poll it over EP0.
+ */
+static const uint8_t hid_empty_report[USB_PACKET_SIZE] = {0};
+
+/**
+ * The feature report is the configuration and status of the
+ * driver on EP0, without taking any slots from the stream:
+ *   0: options compiled in, read only (bit 0 FIFO_STATS,
+ *      1 USB_STREAM_CHECK, 2 USB_STREAM_COMPRESS, 3 USB_STREAM_TIMESTAMP)
+ *   1: USB_CHANNELS, read only
+ *   2: short packets, see DRV_CMD_SET_SHORT_PACKETS
+ *   3: compression, see DRV_CMD_SET_COMPRESSION
+ *   4: TX policy min_bytes, see usb_tx_set_policy()
+ *   5: TX policy max_frames
+ *   6..7: reserved (0)
+ */
+static void get_feature_report(uint8_t* report) {
+    memset(report, 0, USB_FEATURE_REPORT_SIZE);
+#ifdef FIFO_STATS
+    report[0] |= 1 << 0;
+#endif
+#ifdef USB_STREAM_CHECK
+    report[0] |= 1 << 1;
+#endif
+#ifdef USB_STREAM_COMPRESS
+    report[0] |= 1 << 2;
+    report[3] = tx_compress;
+#endif
+#ifdef USB_STREAM_TIMESTAMP
+    report[0] |= 1 << 3;
+#endif
+    report[1] = USB_CHANNELS;
+    report[2] = tx_short_packets;
+    report[4] = tx_policy_min_bytes;
+    report[5] = tx_policy_max_frames;
+}
+
+/**
+ * Apply the writable fields of a feature report from SET_REPORT.
+ */
+static bool set_feature_report(const setup_t* setup, uint8_t* report, uint16_t length) {
+    if (length != USB_FEATURE_REPORT_SIZE) {
+        return false;
+    }
+    tx_short_packets = report[2] != 0;
+#ifdef USB_STREAM_COMPRESS
+    tx_compress = report[3] != 0;
+#endif
+    usb_tx_set_policy(report[4], report[5]);
+    return true;
+}
+#endif
+
+/*
+ * The control transfer on EP0 that is currently in progress. Every
+ * SETUP starts a new one, its data stage is then either IN (the
+ * answer is sent from data in up to 64 byte packets, the pointer
+ * must stay valid until it has been sent) or OUT (the packets are
+ * collected in the caller's buffer and complete is called when all
+ * of them have arrived) or there is none at all. The status stage
+ * is the zero length packet in the opposite direction.
+ */
+typedef enum {
+    CONTROL_IDLE,
+    CONTROL_DATA_IN,        // more IN data to be armed
+    CONTROL_DATA_OUT,       // waiting for more OUT data
+    CONTROL_STATUS_IN,      // ZLP armed, waiting for the host to fetch it
+    CONTROL_STATUS_OUT      // all IN data armed, waiting for the host's ZLP
+} control_stage_t;
+
+static struct {
+    setup_t setup;
+    control_stage_t stage;
+    uint8_t* data;
+    uint16_t length;
+    uint16_t done;
+    bool zlp;
+    usb_control_complete_t complete;
+} control;
+
+/**
+ * Answer the current control request with an IN data stage,
+ * truncated to the wLength of the request. This must only be
+ * called while the SETUP is being handled (for example from
+ * usb_hook_control_request()).
+ */
+void usb_control_send(const void* data, uint16_t length) {
+    control.stage = CONTROL_DATA_IN;
+    control.data = (uint8_t*)data;
+    control.length = length < control.setup.wLength ? length : control.setup.wLength;
+    control.zlp = length < control.setup.wLength;
+}
+
+/**
+ * Receive the OUT data stage (wLength bytes) of the current control
+ * request into buffer, complete will be called from the ISR when it
+ * is complete and it can still reject it. This must only be called
+ * while the SETUP is being handled.
+ * @param complete callback, may be NULL
+ * @return false if the buffer is too small, the request must be stalled
+ */
+bool usb_control_receive(void* buffer, uint16_t size, usb_control_complete_t complete) {
+    if (control.setup.wLength > size) {
+        return false;
+    }
+    control.stage = CONTROL_DATA_OUT;
+    control.data = buffer;
+    control.length = control.setup.wLength;
+    control.done = 0;
+    control.complete = complete;
+    return true;
+}
+
+static void control_stall(void) {
+    control.stage = CONTROL_IDLE;
+    USB0->ENDPOINT[0].ENDPT = USB_ENDPT_EPSTALL_MASK
+                            | USB_ENDPT_EPRXEN_MASK
+                            | USB_ENDPT_EPTXEN_MASK
+                            | USB_ENDPT_EPHSHK_MASK;
+}
+
+/**
+ * Arm the next packet of the IN data stage, a packet shorter than
+ * 64 bytes (if needed one of zero length) ends the data stage.
+ */
+static void control_tx_next(void) {
+    uint16_t size = control.length < ENDPOINT_BUF_SIZE ? control.length : ENDPOINT_BUF_SIZE;
+    endpoint_prepare_next_tx(0, control.data, size);
+    control.data += size;
+    control.length -= size;
+    if (size < ENDPOINT_BUF_SIZE || (control.length == 0 && !control.zlp)) {
+        control.stage = CONTROL_STATUS_OUT;
+    }
+}
+
+/**
+ * The OUT data stage is complete, let the callback have a look at
+ * the data and then acknowledge it in the status stage.
+ */
+static void control_rx_done(void) {
+    if (control.complete && !control.complete(&control.setup, control.data, control.done)) {
+        control_stall();
+        return;
     }
+    control.stage = CONTROL_STATUS_IN;
+    endpoint_prepare_next_tx(0, NULL, 0);
 }
 
-static void endpoint_0_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
-    static setup_t setup;
-    static uint8_t* remaining_tx_data_ptr = NULL;
-    static uint16_t remaining_tx_data_length = 0;
+/**
+ * Handle the requests of a SETUP packet, the standard requests
+ * and those of the class specific interfaces.
+ * @return false if the request must be stalled
+ */
+static bool control_setup(const setup_t* setup) {
+#ifdef USB_ISO_ENDPOINT
+    static uint8_t alt_setting;
+#endif
+#if USB_HID_INTERFACES
+    static uint8_t feature_report[USB_FEATURE_REPORT_SIZE];
+#endif
+
+    switch (setup->wRequestAndType) {
+
+    case 0x0500: //set address (wait for IN packet)
+        return true;
 
-    uint8_t tx_data_length = 0;
-    uint8_t* tx_data_ptr = NULL;
-    uint32_t tx_size = 0;
-    bool must_stall = false;
+    case 0x0900: //set configuration
+        //we only have one configuration at this time
+        return true;
+
+#ifdef USB_ISO_ENDPOINT
+    case 0x0b01: //set interface
+        /*
+         * The isochronous endpoint is only served in alternate
+         * setting 1. When it is set to 0 the buffer descriptors
+         * that are already armed are left as they are, the host
+         * will just not fetch them until it selects 1 again.
+         */
+        if (setup->wIndex == USB_ISO_INTERFACE) {
+            iso_alt_setting = setup->wValue;
+        }
+        return true;
+
+    case 0x0a81: //get interface
+        alt_setting = setup->wIndex == USB_ISO_INTERFACE ? iso_alt_setting : 0;
+        usb_control_send(&alt_setting, 1);
+        return true;
+#endif
+
+#if USB_HID_INTERFACES
+    /*
+     * HID class requests, wIndex is the interface and the high
+     * byte of wValue the report type (1 input, 2 output, 3 feature).
+     * Our reports have no report IDs, output reports only go over
+     * the interrupt OUT endpoints.
+     */
+    case 0x01a1: //HID get report
+        if (setup->wIndex >= USB_HID_INTERFACES) {
+            return false;
+        } else if (setup->wValue == 0x0100) {
+            usb_control_send(hid_empty_report, USB_PACKET_SIZE);
+            return true;
+        } else if (setup->wValue == 0x0300) {
+            get_feature_report(feature_report);
+            usb_control_send(feature_report, USB_FEATURE_REPORT_SIZE);
+            return true;
+        }
+        return false;
+
+    case 0x0921: //HID set report
+        return setup->wIndex < USB_HID_INTERFACES
+            && setup->wValue == 0x0300
+            && usb_control_receive(feature_report, USB_FEATURE_REPORT_SIZE, set_feature_report);
+
+    case 0x0a21: //HID set idle
+        if (setup->wIndex < USB_HID_INTERFACES) {
+            hid_idle_rate = setup->wValue >> 8;
+            return true;
+        }
+        return false;
+
+    case 0x02a1: //HID get idle
+        if (setup->wIndex < USB_HID_INTERFACES) {
+            usb_control_send(&hid_idle_rate, 1);
+            return true;
+        }
+        return false;
+#endif
+
+#if USB_TRANSPORT_CDC
+    case 0x2021: //CDC set line coding
+        return usb_control_receive(cdc_line_coding, CDC_LINE_CODING_SIZE, NULL);
+
+    case 0x2221: //CDC set control line state
+        return true;
+
+    case 0x21a1: //CDC get line coding
+        usb_control_send(cdc_line_coding, CDC_LINE_CODING_SIZE);
+        return true;
+#endif
+
+#ifdef USB_MS_OS_20_VENDOR_CODE
+    /*
+     * The Microsoft OS 2.0 descriptor set is requested with a
+     * vendor request (wIndex = 7), it is in the descriptor
+     * table with wValue = 0 and looked up just like the others.
+     */
+    case (USB_MS_OS_20_VENDOR_CODE << 8) | 0xc0:
+#endif
+    case 0x0680: //get descriptor
+    case 0x0681:
+        for (unsigned i = 0; i < sizeof(descriptor_table) / sizeof(descriptor_table_t); i++) {
+            if (setup->wValue == descriptor_table[i].wValue
+            &&  setup->wIndex == descriptor_table[i].wIndex) {
+                usb_control_send(descriptor_table[i].descriptor, descriptor_table[i].size);
+                usb_hook_led_tx(true);
+                return true;
+            }
+        }
+        return false;
+
+    default:
+        // the standard requests must all be handled above
+        return (setup->bmRequestType & 0x60) != 0 && usb_hook_control_request(setup);
+    }
+}
+
+/**
+ * @return true if the RX buffer descriptor can be released
+ */
+bool endpoint_0_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
+    uint8_t odd;
+    uint16_t size;
 
     switch (tok) {
     case TOK_SETUP:
@@ -393,7 +1799,8 @@ static void endpoint_0_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
          *  instead we copy the entire contents of the packet into
          *  a static struct.
          */
-        setup = *((setup_t*) (buf_desc->addr));
+        control.setup = *((setup_t*) (buf_desc->addr));
+        control.stage = CONTROL_IDLE;
         usb_hook_led_rx(true);
 
         /*
@@ -407,123 +1814,90 @@ static void endpoint_0_handler(uint8_t tok, buffer_descriptor_t* buf_desc) {
         buf_desc_table[BDT_INDEX(0, TX, ODD)].desc = 0;
         endpoint_state[0].tx_data1 = DATA1;
 
-        switch (setup.wRequestAndType) {
-
-        case 0x0500: //set address (wait for IN packet)
-            break;
+        /*
+         * The same goes for the OUT direction, the packet after the
+         * SETUP (OUT data or the status ZLP) is DATA1 and it will go
+         * into the other RX buffer descriptor, the one after it is
+         * DATA0 and will use this one again. From then on both keep
+         * their toggle as usual, see bd_rx_release(). The USB does
+         * not process any tokens until it is unfrozen below.
+         */
+        odd = (buf_desc - buf_desc_table) & 1;
+        buf_desc_table[BDT_INDEX(0, RX, odd ^ 1)].desc = BD_OWNED_BY_USB(endpoint_table[0].size, DATA1);
+        buf_desc->desc = BD_OWNED_BY_USB(endpoint_table[0].size, DATA0);
 
-        case 0x0900: //set configuration
-            //we only have one configuration at this time
-            break;
+        if (!control_setup(&control.setup)) {
+            control_stall();
 
-        case 0x0680: //get descriptor
-        case 0x0681:
-            must_stall = true;
-            const unsigned num_descr = sizeof(descriptor_table) / sizeof(descriptor_table_t);
-            for (unsigned i=0; i<num_descr; i++) {
-                if (setup.wValue == descriptor_table[i].wValue
-                &&  setup.wIndex == descriptor_table[i].wIndex) {
-                    tx_data_ptr = (uint8_t*)descriptor_table[i].descriptor;
-                    tx_data_length = descriptor_table[i].size;
-                    must_stall = false;
-                    usb_hook_led_tx(true);
-                    break;
-                }
+        } else if (control.stage == CONTROL_DATA_IN) {
+            /*
+             * at this point (after a SETUP) we know that both TX buffer
+             * descriptors are free (we forcefully cleared them a few
+             * lines above because every SETUP discards any old pending
+             * IN data). Therefore we can immediately prepare up to two
+             * buffer descriptors with the answer, the rest will be
+             * armed during the subsequent TOK_IN.
+             */
+            control_tx_next();
+            if (control.stage == CONTROL_DATA_IN) {
+                control_tx_next();
             }
-            break;
 
-        default:
-            must_stall = true;
-        }
-
-        if (must_stall) {
-            USB0->ENDPOINT[0].ENDPT = USB_ENDPT_EPSTALL_MASK
-                                    | USB_ENDPT_EPRXEN_MASK
-                                    | USB_ENDPT_EPTXEN_MASK
-                                    | USB_ENDPT_EPHSHK_MASK;
+        } else if (control.stage == CONTROL_DATA_OUT) {
+            if (control.length == 0) {
+                control_rx_done();
+            }
 
         } else {
             /*
-             * truncate the data length to whatever the setup packet is
-             * expecting. if data_length == 0 then this will result in the
-             * sending of a zero length packet which is is the correct
-             * answer for all requests that do not request any data.
+             * no data stage, answer the status stage with
+             * a zero length packet right away.
              */
-            if (tx_data_length > setup.wLength) {
-                tx_data_length = setup.wLength;
-            }
-
-            do {
-                /*
-                 * at this point (after a SETUP) we know that both TX buffer
-                 * descriptors are free (we forcefully cleared them a few
-                 * lines above because every SETUP discards any old pending
-                 * IN data). Therefore we can immediately prepare up to two
-                 * buffer descriptors with your answer.
-                 */
-
-                // transmit 1st chunk
-                tx_size = tx_data_length;
-                if (tx_size > ENDPOINT_BUF_SIZE)
-                    tx_size = ENDPOINT_BUF_SIZE;
-                endpoint_prepare_next_tx(0, tx_data_ptr, tx_size);
-                tx_data_ptr += tx_size; //move the pointer down
-                tx_data_length -= tx_size; //move the size down
-                if (tx_data_length == 0 && tx_size < ENDPOINT_BUF_SIZE)
-                    break; //all done!
-
-                // transmit 2nd chunk
-                tx_size = tx_data_length;
-                if (tx_size > ENDPOINT_BUF_SIZE)
-                    tx_size = ENDPOINT_BUF_SIZE;
-                endpoint_prepare_next_tx(0, tx_data_ptr, tx_size);
-                tx_data_ptr += tx_size; //move the pointer down
-                tx_data_length -= tx_size; //move the size down
-                if (tx_data_length == 0 && tx_size < ENDPOINT_BUF_SIZE)
-                    break; //all done!
-
-                /*
-                 * if any data remains to be transmitted after both
-                 * TX-descriptors are armed then we need to store it,
-                 * the remaining data will be picked up during
-                 * subsequent TOK_IN until all data is sent.
-                 */
-                remaining_tx_data_ptr = tx_data_ptr;
-                remaining_tx_data_length = tx_data_length;
-
-            } while (false);
+            control.stage = CONTROL_STATUS_IN;
+            endpoint_prepare_next_tx(0, NULL, 0);
         }
 
         // must unfreeze after every setup packet
         USB0->CTL = USB_CTL_USBENSOFEN_MASK;
-        break;
+        return false;
 
     case TOK_IN:
-        // continue sending any pending transmit data
-        tx_data_ptr = remaining_tx_data_ptr;
-        if (tx_data_ptr) {
-            tx_size = remaining_tx_data_length;
-            if (tx_size > ENDPOINT_BUF_SIZE)
-                tx_size = ENDPOINT_BUF_SIZE;
-            endpoint_prepare_next_tx(0, tx_data_ptr, tx_size);
-            tx_data_ptr += tx_size;
-            remaining_tx_data_length -= tx_size;
-            remaining_tx_data_ptr =
-                (remaining_tx_data_length > 0 || tx_size == ENDPOINT_BUF_SIZE) ? tx_data_ptr : NULL;
-        }
-
-        // delayed setting of address can happen here
-        if (setup.wRequestAndType == 0x0500) {
-            USB0->ADDR = setup.wValue;
+        if (control.stage == CONTROL_DATA_IN) {
+            // continue sending any pending transmit data
+            control_tx_next();
+
+        } else if (control.stage == CONTROL_STATUS_IN) {
+            control.stage = CONTROL_IDLE;
+
+            // delayed setting of address can happen here
+            if (control.setup.wRequestAndType == 0x0500) {
+                USB0->ADDR = control.setup.wValue;
+            }
         }
         break;
 
     case TOK_OUT:
-        break;
-
-    case TOK_SOF:
+        if (control.stage == CONTROL_DATA_OUT) {
+            /*
+             * collect the data stage in the caller's buffer, it
+             * ends with a short packet or after wLength bytes.
+             */
+            size = buf_desc->desc >> BD_BC_SHIFT & 0x3ff;
+            if (size > control.length - control.done) {
+                size = control.length - control.done;
+            }
+            memcpy(control.data + control.done, (uint8_t*)buf_desc->addr, size);
+            control.done += size;
+            if (size < ENDPOINT_BUF_SIZE || control.done == control.length) {
+                control_rx_done();
+            }
+        } else {
+            // the status stage of an IN transfer
+            control.stage = CONTROL_IDLE;
+        }
         break;
     }
+    return true;
 }
 
 void USB0_IRQHandler(void) {
@@ -539,12 +1913,39 @@ void USB0_IRQHandler(void) {
     if (status & USB_ISTAT_USBRST_MASK) {
         //handle USB reset
 
-        //initialize endpoint 0 ping-pong buffers
+        //initialize the ping-pong buffers of all endpoints
         USB0->CTL |= USB_CTL_ODDRST_MASK;
-        init_buffer_descriptor(0, endpoint_0_rx_buf, ENDPOINT_BUF_SIZE);
+        for (endpoint = 0; endpoint < USB_NUM_ENDPOINTS; endpoint++) {
+            init_buffer_descriptor(endpoint);
+        }
 
-        // initialize endpoint 1
-        init_buffer_descriptor(1, endpoint_1_rx_buf, ENDPOINT_BUF_SIZE);
+        // stream packets in flight will be sent again
+        tx_packets_in_flight = 0;
+        tx_packets_done = 0;
+        tx_messages_in_flight = 0;
+        stream_rx_pending = 0;
+        stream_rx_held = 0;
+        tx_short_packets = false;
+#ifdef USB_STREAM_COMPRESS
+        tx_compress = false;
+#endif
+#if USB_HID_INTERFACES
+        hid_idle_rate = 0;
+#endif
+        rx_credit_enabled = false;
+        rx_stream_packets = 0;
+#ifdef USB_PACKET_SEQUENCE
+        tx_sequence = 0;
+        rx_sequence = 0;
+#endif
+#if USB_TRANSPORT_BULK
+        tx_stream_in_flight = 0;
+        tx_need_zlp = false;
+#endif
+#ifdef USB_ISO_ENDPOINT
+        iso_in_flight = 0;
+        iso_alt_setting = 0;
+#endif
 
         //clear all interrupts...this is a reset
         USB0->ERRSTAT = 0xff;
@@ -575,19 +1976,42 @@ void USB0_IRQHandler(void) {
      * start of frame
      */
     if (status & USB_ISTAT_SOFTOK_MASK) {
+#ifdef USB_STREAM_TIMESTAMP
+        sof_systick = SysTick->VAL;
+#endif
+
         //turn off all LEDs again
         usb_hook_led_rx(false);
         usb_hook_led_tx(false);
 
+        // age of the data waiting in the channels for the TX policy
+        for (uint8_t channel = 0; channel < USB_CHANNELS; channel++) {
+            if (fifo_get_size(&usb_tx_channel[channel]) && tx_wait_frames[channel] < 0xff) {
+                tx_wait_frames[channel]++;
+            }
+        }
+
         /*
-         * periodically poll endpoint 1 so it can check whether the
+         * periodically poll the stream endpoints so they can check whether the
          * application has placed anything in its transmit queue.
          *
          * This is called from here because the token handler would
          * never be called again once the TX buffers have run dry and
          * the hardware automatically NAKs every subsequent TOK_IN.
          */
-        endpoint_1_check_tx();
+        stream_check_tx();
+
+        /*
+         * also resume the reception if the host has been throttled
+         * and the application has been reading usb_rx directly.
+         */
+        stream_check_rx();
+        stream_check_credit();
+
+#ifdef USB_ISO_ENDPOINT
+        // one isochronous frame per SOF
+        iso_check_tx();
+#endif
 
         USB0->ISTAT = USB_ISTAT_SOFTOK_MASK;
     }
@@ -628,13 +2052,13 @@ void USB0_IRQHandler(void) {
         // determine which token has been processed
         uint8_t tok = BD_GET_TOK(buf_desc->desc);
 
-        if (endpoint == 0) {
-            endpoint_0_handler(tok, buf_desc);
-        } else if(endpoint == 1) {
-            endpoint_1_handler(tok, buf_desc);
+        // dispatch to the handler from the endpoint table
+        bool release = true;
+        if (endpoint < USB_NUM_ENDPOINTS && endpoint_table[endpoint].handler) {
+            release = endpoint_table[endpoint].handler(tok, buf_desc);
         }
 
-        if (!tx) {
+        if (!tx && release) {
             // give RX buffer back
             bd_rx_release(buf_desc);
         }
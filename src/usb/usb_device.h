@@ -15,11 +15,122 @@
 #include "usb_descriptors.h"
 #include "fifo.h"
 
+#define USB_PACKET_SIZE             64
+#define USB_PACKET_PAYLOAD_SIZE     (USB_PACKET_SIZE - sizeof(hid_packet_header_t))
+#define USB_MESSAGE_SIZE            USB_PACKET_PAYLOAD_SIZE
+
+#ifndef USB_CHANNELS
+#define USB_CHANNELS                1
+#endif
+
+#if USB_STREAM_LANES > 1 || defined(USB_STREAM_CHECK)
+#define USB_PACKET_SEQUENCE
+#endif
+
+/**
+ * Our hid report packets always include a payload size member
+ * because due to a bug in the generic Windows HID driver it
+ * will always either send a full sized packet or no packet at
+ * all, no matter the actual byte count to transmit. Other hosts
+ * can switch the device to short stream packets with a driver
+ * packet, the header is still needed then to distinguish the
+ * stream data from the other kinds of packets.
+ *
+ * When the stream is striped across more than one lane then
+ * every packet also carries a sequence number (incremented
+ * per packet and separately per direction) so the receiver
+ * can restore the original order of the packets.
+ *
+ * Compressed stream packets (see USB_STREAM_COMPRESS) have bit 6
+ * set in the payload size, the lower bits are then the size of the
+ * compressed payload.
+ *
+ * With more than one virtual channel the stream packets also
+ * carry the number of the channel they belong to.
+ *
+ * With USB_STREAM_TIMESTAMP defined every packet carries the time
+ * the device handed it to the USB (the little endian frame number
+ * from FRMNUML/FRMNUMH in the lower 11 bits, the time since the
+ * SOF in 1/32 frame above) and its age, the number of frames since
+ * its oldest data was queued (saturating at 255). Both are only
+ * set in IN packets, the host sends zeros.
+ *
+ * With USB_STREAM_CHECK defined every packet carries a sequence
+ * number (also with only one lane) and a CRC-8 over the header and
+ * the payload, so lost and corrupted packets can be detected.
+ */
+typedef volatile struct {
+    uint8_t payload_size;
+#ifdef USB_PACKET_SEQUENCE
+    uint8_t sequence;
+#endif
+#if USB_CHANNELS > 1
+    uint8_t channel;
+#endif
+#ifdef USB_STREAM_TIMESTAMP
+    uint8_t timestamp[2];
+    uint8_t age;
+#endif
+#ifdef USB_STREAM_CHECK
+    uint8_t crc;
+#endif
+    uint8_t payload_data[];
+} hid_packet_header_t;
+
+/**
+ * Structure of a SETUP packet, used by endpoint 0
+ */
+typedef struct {
+    union {
+        struct {
+            uint8_t bmRequestType;
+            uint8_t bRequest;
+        };
+        uint16_t wRequestAndType;
+    };
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} setup_t;
+
+/**
+ * Called from the ISR when the OUT data stage of a control transfer
+ * has been received completely, see usb_control_receive().
+ * @return false to reject the data, the status stage is stalled
+ */
+typedef bool (*usb_control_complete_t)(const setup_t* setup, uint8_t* data, uint16_t length);
+
 void usb_device_init(void);
 bool usb_send_message_packet(uint8_t* data, uint8_t size);
+bool usb_poll_message(uint8_t* data);
+void usb_tx_flush(void);
+void usb_tx_set_policy(uint8_t min_bytes, uint8_t max_frames);
+unsigned usb_tx_write(const uint8_t* data, unsigned count);
+unsigned usb_tx_write_channel(uint8_t channel, const uint8_t* data, unsigned count);
+bool usb_tx_set_channel_weight(uint8_t channel, uint8_t weight);
+bool usb_tx_write_record(const uint8_t* data, uint8_t size);
+unsigned usb_rx_read(uint8_t* data, unsigned count);
+unsigned usb_rx_read_channel(uint8_t channel, uint8_t* data, unsigned count);
+hid_packet_header_t* usb_tx_packet_reserve(void);
+void usb_tx_packet_commit(void);
+void usb_control_send(const void* data, uint16_t length);
+bool usb_control_receive(void* buffer, uint16_t size, usb_control_complete_t complete);
+#ifdef USB_ISO_ENDPOINT
+unsigned usb_iso_write(const uint8_t* data, unsigned count);
+#endif
 
-extern fifo_t usb_tx;
-extern fifo_t usb_rx;
+/*
+ * usb_tx must not be written to directly if more than one context
+ * (main() and the hooks) is producing data, use usb_tx_write().
+ * usb_tx and usb_rx are the FIFOs of channel 0.
+ */
+extern fifo_t usb_tx_channel[USB_CHANNELS];
+extern fifo_t usb_rx_channel[USB_CHANNELS];
+#define usb_tx                      (usb_tx_channel[0])
+#define usb_rx                      (usb_rx_channel[0])
+#ifdef USB_ISO_ENDPOINT
+extern fifo_t usb_iso;
+#endif
 
 /*
  * The hooks below can be implemented by the application,
@@ -27,6 +138,6 @@ extern fifo_t usb_rx;
  */
 extern void usb_hook_led_tx(bool on);
 extern void usb_hook_led_rx(bool on);
-extern void usb_hook_message_packet(volatile uint8_t* data);
+extern bool usb_hook_control_request(const setup_t* setup);
 
 #endif /* SRC_USB_USB_DEVICE_H_ */
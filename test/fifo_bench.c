@@ -0,0 +1,81 @@
+/*
+ * fifo_bench.c
+ *
+ * Host benchmark for the bulk fifo_write()/fifo_read() against
+ * the single byte fifo_push()/fifo_pop(), moving the same data
+ * through the FIFO in packet sized chunks like the USB hot paths.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "fifo.h"
+
+#define TOTAL_BYTES     (64u * 1024 * 1024)
+#define CHUNK           63
+
+static uint8_t fifo_buf[512];
+static fifo_t fifo;
+static uint8_t src[CHUNK];
+static uint8_t dst[CHUNK];
+static uint32_t checksum;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned run_bytewise(void) {
+    unsigned calls = 0;
+    for (unsigned done = 0; done < TOTAL_BYTES; done += CHUNK) {
+        for (unsigned i = 0; i < CHUNK; i++) {
+            fifo_push(&fifo, src[i]);
+        }
+        for (unsigned i = 0; i < CHUNK; i++) {
+            fifo_pop(&fifo, &dst[i]);
+        }
+        calls += 2 * CHUNK;
+        checksum += dst[done % CHUNK];
+    }
+    return calls;
+}
+
+static unsigned run_bulk(void) {
+    unsigned calls = 0;
+    for (unsigned done = 0; done < TOTAL_BYTES; done += CHUNK) {
+        fifo_write(&fifo, src, CHUNK);
+        fifo_read(&fifo, dst, CHUNK);
+        calls += 2;
+        checksum += dst[done % CHUNK];
+    }
+    return calls;
+}
+
+static double bench(const char* name, unsigned (*run)(void)) {
+    fifo_init(&fifo, fifo_buf, sizeof(fifo_buf));
+    memset(dst, 0, sizeof(dst));
+    double t = now();
+    unsigned calls = run();
+    t = now() - t;
+    if (memcmp(src, dst, CHUNK) != 0 || fifo_get_size(&fifo) != 0) {
+        printf("%s: FAILED, data mismatch\n", name);
+        return -1;
+    }
+    printf("%-10s %6.2f ns/byte, %5.1f bytes per call\n",
+           name, t * 1e9 / TOTAL_BYTES, 2.0 * TOTAL_BYTES / calls);
+    return t;
+}
+
+int main(void) {
+    for (unsigned i = 0; i < CHUNK; i++) {
+        src[i] = i * 7 + 1;
+    }
+    double bytewise = bench("push/pop", run_bytewise);
+    double bulk = bench("write/read", run_bulk);
+    if (bytewise < 0 || bulk < 0) {
+        return 1;
+    }
+    printf("speedup    %6.1fx (checksum %u)\n", bytewise / bulk, checksum);
+    return 0;
+}
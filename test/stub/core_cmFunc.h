@@ -0,0 +1,51 @@
+/*
+ * core_cmFunc.h
+ *
+ * Host replacement for the CMSIS core functions. The interrupts of
+ * a host test are POSIX signals, so masking the interrupts blocks the
+ * signals. A signal handler that stands for an ISR must set
+ * host_primask while it runs, because another interrupt can not
+ * preempt it either (the kernel blocks the signal meanwhile).
+ */
+
+#ifndef __CORE_CMFUNC_H
+#define __CORE_CMFUNC_H
+
+#include <stdint.h>
+#include <signal.h>
+
+static volatile sig_atomic_t host_primask = 0;
+
+static inline void host_mask_signals(int how) {
+    sigset_t set;
+    sigfillset(&set);
+    sigprocmask(how, &set, NULL);
+}
+
+static inline void __disable_irq(void) {
+    if (!host_primask) {
+        host_mask_signals(SIG_BLOCK);
+        host_primask = 1;
+    }
+}
+
+static inline void __enable_irq(void) {
+    if (host_primask) {
+        host_primask = 0;
+        host_mask_signals(SIG_UNBLOCK);
+    }
+}
+
+static inline uint32_t __get_PRIMASK(void) {
+    return host_primask;
+}
+
+static inline void __set_PRIMASK(uint32_t primask) {
+    if (primask) {
+        __disable_irq();
+    } else {
+        __enable_irq();
+    }
+}
+
+#endif /* __CORE_CMFUNC_H */
@@ -0,0 +1,17 @@
+/*
+ * core_cmInstr.h
+ *
+ * Host replacement for the CMSIS core instruction intrinsics,
+ * found before the real one by the include path of the host tests.
+ */
+
+#ifndef __CORE_CMINSTR_H
+#define __CORE_CMINSTR_H
+
+#define __NOP()     ((void)0)
+#define __WFI()     ((void)0)
+#define __DSB()     __sync_synchronize()
+#define __ISB()     __sync_synchronize()
+#define __DMB()     __sync_synchronize()
+
+#endif /* __CORE_CMINSTR_H */
@@ -0,0 +1,141 @@
+/*
+ * usb_tx_stress.c
+ *
+ * Host stress test for usb_tx_write() with more than one producer.
+ * main() writes into usb_tx in a loop while a fast periodic timer
+ * signal plays the USB interrupt: it completes the armed TX buffer
+ * descriptors of the stream endpoint like the host would fetch them
+ * and then it writes into usb_tx itself, like a hook would. Masking
+ * the interrupts blocks the signal, see stub/core_cmFunc.h.
+ *
+ * All the bytes of one call have the same value, unique among the
+ * producers and different from the previous call of the same
+ * producer, so every call must show up in the received stream as
+ * exactly one run of as many bytes as usb_tx_write() returned
+ * (which may be less than requested when usb_tx is nearly full).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// the driver is compiled right into the test to reach its statics
+#include "usb_device.c"
+
+#define PRODUCERS       2
+#define CALLS           200
+#define MAX_WRITE       100
+#define STREAM_SIZE     (PRODUCERS * CALLS * MAX_WRITE)
+
+#define PRODUCER_MAIN   0
+#define PRODUCER_HOOK   1
+
+typedef struct {
+    unsigned seed;
+    unsigned call;
+    unsigned written[CALLS];
+} producer_t;
+
+static producer_t producers[PRODUCERS] = {{.seed = 1}, {.seed = 2}};
+static uint8_t stream[STREAM_SIZE];
+static unsigned stream_size = 0;
+static uint8_t host_odd = EVEN;
+
+static uint8_t call_value(unsigned id, unsigned call) {
+    return id * 64 + call % 64;
+}
+
+/**
+ * Make the next call of a producer, a call that could not
+ * write anything at all is not counted and will be repeated.
+ */
+static void produce(unsigned id) {
+    producer_t* p = &producers[id];
+    uint8_t data[MAX_WRITE];
+    unsigned count = 1 + rand_r(&p->seed) % MAX_WRITE;
+    memset(data, call_value(id, p->call), count);
+    if ((p->written[p->call] = usb_tx_write(data, count))) {
+        p->call++;
+    }
+}
+
+/**
+ * Play the USB: take every armed TX buffer descriptor of the
+ * stream endpoint in ping-pong order and complete it.
+ */
+static void host_fetch(void) {
+    buffer_descriptor_t* bd;
+    stream_check_tx();
+    while ((bd = &buf_desc_table[BDT_INDEX(STREAM_ENDPOINT(0), TX, host_odd)])->desc & BD_OWN_MASK) {
+        hid_packet_header_t* p = (hid_packet_header_t*)bd->addr;
+        memcpy(&stream[stream_size], (uint8_t*)p->payload_data, p->payload_size);
+        stream_size += p->payload_size;
+        bd->desc &= ~BD_OWN_MASK;
+        stream_handler(TOK_IN, bd);
+        host_odd ^= 1;
+    }
+}
+
+static void usb_interrupt(int sig) {
+    host_primask = 1;
+    host_fetch();
+    if (producers[PRODUCER_HOOK].call < CALLS) {
+        produce(PRODUCER_HOOK);
+    }
+    host_primask = 0;
+}
+
+static bool check(void) {
+    unsigned pos = 0;
+    unsigned next[PRODUCERS] = {0};
+    unsigned runs = 0;
+
+    while (pos < stream_size) {
+        uint8_t value = stream[pos];
+        unsigned id = value / 64;
+        unsigned len = 0;
+        while (pos < stream_size && stream[pos] == value) {
+            pos++;
+            len++;
+        }
+        if (id >= PRODUCERS) {
+            printf("FAILED: unknown byte 0x%02x at %u\n", value, pos - len);
+            return false;
+        }
+        unsigned call = next[id]++;
+        if (call == CALLS || value != call_value(id, call) || len != producers[id].written[call]) {
+            printf("FAILED: producer %u call %u interleaved at %u\n", id, call, pos - len);
+            return false;
+        }
+        runs++;
+    }
+    if (runs != PRODUCERS * CALLS) {
+        printf("FAILED: only %u of %u calls received\n", runs, PRODUCERS * CALLS);
+        return false;
+    }
+    printf("usb_tx_write: %u calls from %u producers, %u bytes, no interleaving\n",
+           runs, PRODUCERS, stream_size);
+    return true;
+}
+
+int main(void) {
+    struct itimerval timer = {{0, 20}, {0, 20}};
+
+    fifo_init(&usb_tx, tx_fifo_buf[0], sizeof(tx_fifo_buf[0]));
+    fifo_init(&usb_rx, rx_fifo_buf[0], sizeof(rx_fifo_buf[0]));
+    fifo_init(&tx_packets, tx_packet_buf, sizeof(tx_packet_buf));
+    fifo_init(&tx_messages, tx_message_buf, sizeof(tx_message_buf));
+
+    signal(SIGALRM, usb_interrupt);
+    setitimer(ITIMER_REAL, &timer, NULL);
+    while (producers[PRODUCER_MAIN].call < CALLS || producers[PRODUCER_HOOK].call < CALLS) {
+        if (producers[PRODUCER_MAIN].call < CALLS) {
+            produce(PRODUCER_MAIN);
+        }
+    }
+    __disable_irq();
+    while (fifo_get_size(&usb_tx) || fifo_get_size(&tx_packets)) {
+        host_fetch();
+    }
+    return check() ? 0 : 1;
+}